@@ -1,16 +1,17 @@
-# Compile main:
-clang++ -o dist/eva-llvm `llvm-config --cxxflags --ldflags --system-libs --libs core` eva-llvm.cpp
-
-# Run main:
-./dist/eva-llvm
+# Compile the GC runtime (linked into executables, and into the compiler for the JIT):
+clang++ -c -O2 -fno-omit-frame-pointer -std=c++17 -o dist/EvaGC.o src/runtime/EvaGC.cpp
+ar rcs dist/libevagc.a dist/EvaGC.o
 
-# Execute generated IR:
-# lli ./dist/out.ll
+# Compile main:
+clang++ -o dist/eva-llvm `llvm-config --cxxflags --ldflags --system-libs --libs core passes native lto orcjit` -std=c++17 eva-llvm.cpp dist/libevagc.a
 
-# Optimize the output:
-opt ./dist/out.ll -passes='default<O3>' -S -o ./dist/out-opt.ll
+# Run main (optimizes, emits and links the executable in-process, with the precise GC;
+# --gc boehm --gc-lib /usr/lib/x86_64-linux-gnu/libgc.a for the Boehm GC):
+./dist/eva-llvm -O3 --emit exe "$@"
 
-clang++ -O3 -I/usr/local/include/gc/ ./dist/out-opt.ll /usr/lib/x86_64-linux-gnu/libgc.a -o ./dist/out
+# Execute generated IR (--emit ll --gc=boehm; the precise GC's IR is
+# lowered and linked with its runtime only by eva-llvm itself):
+# lli --dlopen=/usr/lib/x86_64-linux-gnu/libgc.so.1 ./dist/out.ll
 
 # Run the compiled program
 ./dist/out
@@ -18,4 +19,4 @@ clang++ -O3 -I/usr/local/include/gc/ ./dist/out-opt.ll /usr/lib/x86_64-linux-gnu
 # Print result
 echo $?
 
-printf "\n"
\ No newline at end of file
+printf "\n"
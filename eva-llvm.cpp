@@ -1,6 +1,8 @@
 #include <string>
+#include <string_view>
 #include <iostream>
-#include <fstream>
+
+#include "llvm/Support/MemoryBuffer.h"
 
 #include "./src/EvaLLVM.h"
 
@@ -8,56 +10,237 @@ void printHelp() {
     std::cout << "\nUsage: eva-llvm [options]\n\n"
               << "Options:\n"
               << "  -e, --expression    Expression to parse\n"
-              << "  -f, --file          File to parse\n\n";
+              << "  -f, --file          File to parse\n"
+              << "  --ast-cache         Cache the parsed AST of the file in <file>c\n"
+              << "  --emit=ll|bc|obj|exe|none  Output kind (default: ll)\n"
+              << "  -o, --output        Output file, - for stdout (default: ./dist/out.<kind>)\n"
+              << "  --mcpu=<cpu>        Target CPU, or native (default: generic, native for --jit)\n"
+              << "  --mattr=<features>  Target features, e.g. +avx2,-avx512f\n"
+              << "  --gc=precise|boehm  Garbage collector (default: precise, generational)\n"
+              << "  --gc-lib            GC runtime for executables (default: libevagc.a, -lgc for Boehm)\n"
+              << "  --incremental-cache Cache object code of functions in a directory (--emit exe)\n"
+              << "  --codegen-partitions  Optimize and compile N partitions in parallel (--emit exe)\n"
+              << "  -j, --jit           Run the program in-process instead of emitting it\n"
+              << "  --jit-eager         Compile all functions before running (default: on first call)\n"
+              << "  --jit-tiered        Run unoptimized code first, recompile hot functions optimized\n"
+              << "  --jit-tier-threshold  Calls and loop iterations before recompiling (default: 1000)\n"
+              << "  -O0 .. -O3, -Os     Optimization level (default: -O0)\n"
+              << "  --passes            Custom pass pipeline, e.g. \"function(mem2reg,instcombine)\"\n"
+              << "  --time-report       Print compile time and statistics to stderr\n"
+              << "  --time-report-json  Write the time report as JSON to a file\n\n";
 }
 
 int main(int argc, char const *argv[])
 {
-    if (argc != 3) {
-        printHelp();
-        return 0;
-    }
-
     /**
-     * Expression Mode
+     * Program to execute (a view into the argument or the file buffer)
     */
-    std::string mode = argv[1];
+    std::string_view program;
 
     /**
-     * Program to execute
+     * Source file name, if the program is read from a file
     */
-    std::string program;
+    std::string fileName;
 
     /**
-     * Simple expression
+     * Source file, memory-mapped when large enough
     */
-    if (mode == "-e") {
-        program = argv[2];
-    }
+    std::unique_ptr<llvm::MemoryBuffer> programFile;
 
     /**
-     * Eva File
+     * Compiler options
     */
-    else if (mode == "-f") {
-        // Read the file
-        std::ifstream programFile(argv[2]);
-        std::stringstream buffer;
-        buffer << programFile.rdbuf() << "\n";
+    CompilerOptions options;
+
+    bool hasProgram = false;
+    bool useAstCache = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+
+        /**
+         * Simple expression
+        */
+        if ((arg == "-e" || arg == "--expression") && i + 1 < argc) {
+            program = argv[++i];
+            hasProgram = true;
+        }
+
+        /**
+         * Eva File
+        */
+        else if ((arg == "-f" || arg == "--file") && i + 1 < argc) {
+            fileName = argv[++i];
+            hasProgram = true;
+        }
+
+        else if (arg == "--ast-cache") {
+            useAstCache = true;
+        }
+
+        else if ((arg == "--emit" && i + 1 < argc) || arg.substr(0, 7) == "--emit=") {
+            std::string_view kind = arg == "--emit" ? argv[++i] : arg.substr(7);
+
+            if (kind == "ll") {
+                options.emit = EmitKind::LL;
+            } else if (kind == "bc") {
+                options.emit = EmitKind::BC;
+            } else if (kind == "obj") {
+                options.emit = EmitKind::OBJ;
+            } else if (kind == "exe") {
+                options.emit = EmitKind::EXE;
+            } else if (kind == "none") {
+                options.emit = EmitKind::NONE;
+            } else {
+                printHelp();
+                return 0;
+            }
+        }
+
+        else if ((arg == "--mcpu" && i + 1 < argc) || arg.substr(0, 7) == "--mcpu=") {
+            options.cpu = arg == "--mcpu" ? argv[++i] : arg.substr(7);
+        }
+
+        else if ((arg == "--mattr" && i + 1 < argc) || arg.substr(0, 8) == "--mattr=") {
+            options.features = arg == "--mattr" ? argv[++i] : arg.substr(8);
+        }
+
+        else if ((arg == "-o" || arg == "--output") && i + 1 < argc) {
+            options.outputFile = argv[++i];
+        }
+
+        else if ((arg == "--gc" && i + 1 < argc) || arg.substr(0, 5) == "--gc=") {
+            std::string_view kind = arg == "--gc" ? argv[++i] : arg.substr(5);
+
+            if (kind == "precise") {
+                options.gc = GCKind::PRECISE;
+            } else if (kind == "boehm") {
+                options.gc = GCKind::BOEHM;
+            } else {
+                printHelp();
+                return 0;
+            }
+        }
+
+        else if (arg == "--gc-lib" && i + 1 < argc) {
+            options.gcLib = argv[++i];
+        }
+
+        else if (arg == "--incremental-cache" && i + 1 < argc) {
+            options.incrementalCacheDir = argv[++i];
+        }
+
+        else if (arg == "--codegen-partitions" && i + 1 < argc) {
+            options.codegenPartitions = std::max(1, atoi(argv[++i]));
+        }
+
+        else if (arg == "-j" || arg == "--jit") {
+            options.jit = true;
+        }
+
+        else if (arg == "--jit-eager") {
+            options.jit = true;
+            options.lazyJit = false;
+        }
+
+        else if (arg == "--jit-tiered") {
+            options.jit = true;
+            options.tieredJit = true;
+        }
+
+        else if (arg == "--jit-tier-threshold" && i + 1 < argc) {
+            options.tierUpThreshold = std::max(1, atoi(argv[++i]));
+        }
+
+        else if (arg == "-O0") {
+            options.optLevel = llvm::OptimizationLevel::O0;
+        }
+
+        else if (arg == "-O1") {
+            options.optLevel = llvm::OptimizationLevel::O1;
+        }
+
+        else if (arg == "-O2") {
+            options.optLevel = llvm::OptimizationLevel::O2;
+        }
+
+        else if (arg == "-O3") {
+            options.optLevel = llvm::OptimizationLevel::O3;
+        }
+
+        else if (arg == "-Os") {
+            options.optLevel = llvm::OptimizationLevel::Os;
+        }
+
+        else if (arg == "--passes" && i + 1 < argc) {
+            options.passPipeline = argv[++i];
+        }
+
+        else if (arg == "--time-report") {
+            options.timeReport = true;
+        }
+
+        else if (arg == "--time-report-json" && i + 1 < argc) {
+            options.timeReportJsonPath = argv[++i];
+        }
+
+        else {
+            printHelp();
+            return 0;
+        }
+    }
+
+    if (!hasProgram) {
+        printHelp();
+        return 0;
+    }
+
+    if (!options.incrementalCacheDir.empty() && (options.emit != EmitKind::EXE || options.jit)) {
+        std::cerr << "--incremental-cache requires --emit exe\n";
+        return EXIT_FAILURE;
+    }
+
+    if (options.codegenPartitions > 1 && (options.emit != EmitKind::EXE || options.jit)) {
+        std::cerr << "--codegen-partitions requires --emit exe\n";
+        return EXIT_FAILURE;
+    }
+
+    if (!fileName.empty()) {
+        // Map the file, the parser reads it in place
+        auto buffer = llvm::MemoryBuffer::getFile(
+            fileName, /* IsText */ false, /* RequiresNullTerminator */ false);
+
+        if (!buffer) {
+            std::cerr << "Cannot read file " << fileName << ": "
+                      << buffer.getError().message() << "\n";
+            return EXIT_FAILURE;
+        }
+
+        programFile = std::move(*buffer);
 
         // Program:
-        program = buffer.str();
+        program = programFile->getBuffer();
+    }
+
+    options.sourceFile = fileName;
+
+    if (useAstCache && !fileName.empty()) {
+        options.astCachePath = fileName + "c";
     }
 
     /**
      * Compiler Instance
     */
-    EvaLLVM vm;
+    EvaLLVM vm(options);
 
     /**
-     * Generate LLVM IR
+     * Generate LLVM IR, or run the program
     */
-    vm.exec(program);
-    printf("\n");
+    auto exitCode = vm.exec(program);
+
+    if (options.jit) {
+        printf("\n");
+    }
 
-    return 0;
+    return exitCode;
 }
@@ -0,0 +1,293 @@
+/**
+ * Precompiled AST cache (.evac files)
+*/
+
+#ifndef AstCache_h
+#define AstCache_h
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include "./parser/EvaParser.h"
+#include "SymbolTable.h"
+
+/**
+ * Saves a parsed program, and loads it back if the source did not change.
+ *
+ * File layout (native byte order):
+ *
+ *   Header
+ *   Node[nodesCount]           flat nodes, entries of a list are contiguous
+ *   Name[symbolsCount]         distinct symbols of the program
+ *   char[stringsSize]          names of symbols and contents of strings
+ *
+ * The file is read in place from a mapped buffer: strings of the loaded
+ * AST are views into it, so the cache should outlive the AST.
+*/
+class AstCache {
+    public:
+        AstCache(std::string path) : path_(std::move(path)) {}
+
+        /**
+         * Loads the AST of the source into the arena, if the cache
+         * matches the source. Returns false on a miss.
+        */
+        bool load(std::string_view source, ExpArena& arena, Exp& ast) {
+            auto buffer = llvm::MemoryBuffer::getFile(
+                path_, /* IsText */ false, /* RequiresNullTerminator */ false);
+
+            if (!buffer) {
+                return false;
+            }
+
+            auto data = (*buffer)->getBuffer();
+
+            if (data.size() < sizeof(Header)) {
+                return false;
+            }
+
+            auto header = reinterpret_cast<const Header*>(data.data());
+
+            if (std::memcmp(header->magic, MAGIC, sizeof(header->magic)) != 0 ||
+                header->version != VERSION ||
+                header->sourceSize != source.size() ||
+                data.size() != sizeof(Header) + (uint64_t)header->nodesCount * sizeof(Node) +
+                                   (uint64_t)header->symbolsCount * sizeof(Name) + header->stringsSize ||
+                header->root >= header->nodesCount ||
+                header->sourceHash != hash(source)) {
+                return false;
+            }
+
+            auto nodes = reinterpret_cast<const Node*>(data.data() + sizeof(Header));
+            auto names = reinterpret_cast<const Name*>(nodes + header->nodesCount);
+            auto strings = reinterpret_cast<const char*>(names + header->symbolsCount);
+
+            // Each distinct symbol is interned once
+            std::vector<Symbol> symbolIds(header->symbolsCount);
+
+            for (uint32_t i = 0; i < header->symbolsCount; i++) {
+                if ((uint64_t)names[i].offset + names[i].length > header->stringsSize) {
+                    return false;
+                }
+
+                symbolIds[i] = symbols().intern(std::string_view(strings + names[i].offset, names[i].length));
+            }
+
+            // All nodes are decoded into one arena range, at their file
+            // positions, so lists point to their (contiguous) entries.
+            auto exps = arena.allocate(header->nodesCount);
+
+            for (uint32_t i = 0; i < header->nodesCount; i++) {
+                auto& node = nodes[i];
+                auto exp = new (&exps[i]) Exp(ExpList{});
+
+                switch (node.type()) {
+                    case ExpType::NUMBER:
+                        *exp = Exp((int)node.a);
+                        break;
+
+                    case ExpType::STRING:
+                        if ((uint64_t)node.a + node.b() > header->stringsSize) {
+                            return false;
+                        }
+
+                        exp->type = ExpType::STRING;
+                        exp->string = std::string_view(strings + node.a, node.b());
+                        break;
+
+                    case ExpType::SYMBOL:
+                        if (node.a >= header->symbolsCount) {
+                            return false;
+                        }
+
+                        exp->type = ExpType::SYMBOL;
+                        exp->symbol = symbolIds[node.a];
+                        exp->string = std::string_view(strings + names[node.a].offset, names[node.a].length);
+                        break;
+
+                    case ExpType::LIST:
+                        if ((uint64_t)node.a + node.b() > header->nodesCount) {
+                            return false;
+                        }
+
+                        exp->list = ExpList{exps + node.a, node.b()};
+                        break;
+                }
+            }
+
+            ast = exps[header->root];
+            savedParseMicros_ = header->parseMicros;
+            buffer_ = std::move(*buffer);
+
+            return true;
+        }
+
+        /**
+         * Saves the AST of the source. `parseMicros` is the time
+         * it took to parse, which is reported on later hits.
+        */
+        bool save(std::string_view source, const Exp& ast, uint64_t parseMicros) {
+            std::vector<Node> nodes;
+            std::vector<Name> names;
+            std::string strings;
+            std::unordered_map<Symbol, uint32_t> symbolIndices;
+
+            // Breadth-first, so entries of each list are contiguous
+            std::vector<const Exp*> queue{&ast};
+
+            for (size_t i = 0; i < queue.size(); i++) {
+                auto& exp = *queue[i];
+                uint32_t a = 0;
+                size_t b = 0;
+
+                switch (exp.type) {
+                    case ExpType::NUMBER:
+                        a = (uint32_t)exp.number;
+                        break;
+
+                    case ExpType::STRING:
+                        a = strings.size();
+                        b = exp.string.size();
+                        strings += exp.string;
+                        break;
+
+                    case ExpType::SYMBOL: {
+                        auto it = symbolIndices.find(exp.symbol);
+
+                        if (it == symbolIndices.end()) {
+                            it = symbolIndices.emplace(exp.symbol, names.size()).first;
+                            names.push_back(Name{(uint32_t)strings.size(), (uint32_t)exp.string.size()});
+                            strings += exp.string;
+                        }
+
+                        a = it->second;
+                        break;
+                    }
+
+                    case ExpType::LIST:
+                        a = queue.size();
+                        b = exp.list.size();
+
+                        for (auto& entry : exp.list) {
+                            queue.push_back(&entry);
+                        }
+                        break;
+                }
+
+                // Sizes which do not fit the format
+                if (b > B_MASK || queue.size() > UINT32_MAX || strings.size() > UINT32_MAX) {
+                    return false;
+                }
+
+                nodes.push_back(Node{a, ((uint32_t)exp.type << TYPE_SHIFT) | (uint32_t)b});
+            }
+
+            Header header{};
+            std::memcpy(header.magic, MAGIC, sizeof(header.magic));
+            header.version = VERSION;
+            header.sourceHash = hash(source);
+            header.sourceSize = source.size();
+            header.parseMicros = parseMicros;
+            header.nodesCount = nodes.size();
+            header.symbolsCount = names.size();
+            header.stringsSize = strings.size();
+            header.root = 0;
+
+            std::error_code errorCode;
+            llvm::raw_fd_ostream out(path_, errorCode);
+
+            if (errorCode) {
+                return false;
+            }
+
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(Node));
+            out.write(reinterpret_cast<const char*>(names.data()), names.size() * sizeof(Name));
+            out.write(strings.data(), strings.size());
+
+            return !out.has_error();
+        }
+
+        /**
+         * Cache file path.
+        */
+        const std::string& path() const { return path_; }
+
+        /**
+         * Parse time recorded in the cache file, on a hit.
+        */
+        uint64_t savedParseMicros() const { return savedParseMicros_; }
+
+    private:
+        /**
+         * Format version: bump on any change of the layout or the AST.
+        */
+        static constexpr uint32_t VERSION = 1;
+
+        static constexpr char MAGIC[4] = {'E', 'V', 'A', 'C'};
+
+        struct Header {
+            char magic[4];
+            uint32_t version;
+            uint64_t sourceHash;
+            uint64_t sourceSize;
+            uint64_t parseMicros;
+            uint32_t nodesCount;
+            uint32_t symbolsCount;
+            uint32_t stringsSize;
+            uint32_t root;
+        };
+
+        /**
+         * Numbers: a = value.
+         * Strings: a = offset in the strings, b = length.
+         * Symbols: a = index in the names.
+         * Lists: a = index of the first entry, b = number of entries.
+         *
+         * The expression type is kept in the high bits of `b`.
+        */
+        struct Node {
+            uint32_t a;
+            uint32_t typeAndB;
+
+            ExpType type() const { return (ExpType)(typeAndB >> TYPE_SHIFT); }
+            uint32_t b() const { return typeAndB & B_MASK; }
+        };
+
+        /**
+         * Symbol name: a range of the strings.
+        */
+        struct Name {
+            uint32_t offset;
+            uint32_t length;
+        };
+
+        static constexpr uint32_t TYPE_SHIFT = 30;
+        static constexpr uint32_t B_MASK = (1u << TYPE_SHIFT) - 1;
+
+        static_assert(sizeof(Header) % alignof(Node) == 0, "Nodes follow the header");
+
+        static uint64_t hash(std::string_view source) {
+            return llvm::xxHash64(llvm::StringRef(source.data(), source.size()));
+        }
+
+        std::string path_;
+
+        /**
+         * Mapped cache file, the loaded AST refers to its strings.
+        */
+        std::unique_ptr<llvm::MemoryBuffer> buffer_;
+
+        uint64_t savedParseMicros_ = 0;
+};
+
+#endif
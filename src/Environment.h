@@ -5,62 +5,125 @@
 #ifndef Environment_h
 #define Environment_h
 
-#include <map>
-#include <memory>
-#include <string>
+#include <cstdint>
+#include <vector>
 
 #include "llvm/IR/Value.h"
 #include "Logger.h"
+#include "SymbolTable.h"
 
-class Environment : public std::enable_shared_from_this<Environment> {
+/**
+ * Lexical scopes of the code being compiled.
+ *
+ * Code is generated in a single pass, so scopes are entered and exited in
+ * LIFO order, and only the innermost binding of each name is visible. The
+ * bindings of all open scopes are kept on one flat stack, and each symbol
+ * ID indexes its innermost binding, so lookups are a single indexed load,
+ * without hashing or walking parent scopes. Entering a scope allocates
+ * nothing, exiting it pops its bindings, restoring the shadowed ones.
+*/
+class Environment {
     public:
-    
         /**
-         * Creates an environment with the given record.
+         * Opens a scope for the lifetime of the guard.
         */
-        Environment(std::map<std::string, llvm::Value*> record, std::shared_ptr<Environment> parent) : record_(record), parent_(parent) {}
+        class Scope {
+            public:
+                Scope(Environment& env) : env_(env) { env_.enterScope(); }
+                ~Scope() { env_.exitScope(); }
+
+                Scope(const Scope&) = delete;
+                Scope& operator=(const Scope&) = delete;
+
+            private:
+                Environment& env_;
+        };
 
         /**
-         * Creates a variable with the given name and values
+         * Opens a nested scope.
         */
-        llvm::Value* define(const std::string& name, llvm::Value* value) {
-            record_[name] = value;
-            return value;
+        void enterScope() {
+            scopes_.push_back(bindings_.size());
         }
 
         /**
-         * Returns the value of a defined variable, or throws if the variable is not defined.
+         * Closes the innermost scope, dropping its bindings.
         */
-        llvm::Value* lookup(const std::string& name) {
-            return resolve(name)->record_[name];
-        }
+        void exitScope() {
+            auto scopeStart = scopes_.back();
+            scopes_.pop_back();
 
-    private:
+            while (bindings_.size() > scopeStart) {
+                auto& binding = bindings_.back();
+                innermost_[binding.name] = binding.shadowed;
+                bindings_.pop_back();
+            }
+        }
 
         /**
-         * Returns specific environment in which a variable is defined, or throws if a variable is not defined
+         * Creates a variable with the given name and values in the innermost scope
         */
-        std::shared_ptr<Environment> resolve(const std::string& name) {
-            if (record_.count(name) != 0) {
-                return shared_from_this();
+        llvm::Value* define(Symbol name, llvm::Value* value) {
+            if (name >= innermost_.size()) {
+                innermost_.resize(name + 1, NONE);
             }
 
-            if (parent_ == nullptr) {
-                DIE << "Variable \"" << name << "\" is not defined.";
+            auto idx = innermost_[name];
+
+            // Redefinition in the same scope
+            if (idx != NONE && idx >= currentScopeStart()) {
+                bindings_[idx].value = value;
+                return value;
             }
 
-            return parent_->resolve(name);
+            innermost_[name] = bindings_.size();
+            bindings_.push_back({name, value, idx});
+
+            return value;
         }
 
         /**
-         * Bindings Storage
+         * Returns the value of a defined variable, or throws if the variable is not defined.
         */
-        std::map<std::string, llvm::Value*> record_;
+        llvm::Value* lookup(Symbol name) const {
+            if (name >= innermost_.size() || innermost_[name] == NONE) {
+                DIE << "Variable \"" << symbols().name(name) << "\" is not defined.";
+            }
 
-       /**
-        * Parent Link
-       */
-        std::shared_ptr<Environment> parent_;
+            return bindings_[innermost_[name]].value;
+        }
+
+    private:
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        struct Binding {
+            Symbol name;
+            llvm::Value* value;
+
+            /**
+             * Binding of the same name in an outer scope, or NONE
+            */
+            uint32_t shadowed;
+        };
+
+        uint32_t currentScopeStart() const {
+            return scopes_.empty() ? 0 : scopes_.back();
+        }
+
+        /**
+         * Bindings of all open scopes, outer first
+        */
+        std::vector<Binding> bindings_;
+
+        /**
+         * Symbol ID -> index of its innermost binding, or NONE
+        */
+        std::vector<uint32_t> innermost_;
+
+        /**
+         * Start of each open scope in the bindings
+        */
+        std::vector<uint32_t> scopes_;
 };
 
-#endif
\ No newline at end of file
+#endif
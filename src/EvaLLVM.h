@@ -5,35 +5,244 @@
 #ifndef EvaLLVM_h
 #define EvaLLVM_h
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <string>
-#include <regex>
+#include <string_view>
 #include <memory>
 #include <map>
-
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "llvm/Analysis/ModuleSummaryAnalysis.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/BuiltinGCs.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/LTO/LTO.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Scalar/RewriteStatepointsForGC.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
 
 #include "./parser/EvaParser.h"
+#include "./parser/ParallelParser.h"
+#include "./runtime/EvaGC.h"
+#include "AstCache.h"
+#include "HeapToStack.h"
+#include "IncrementalCache.h"
+#include "InlineAllocation.h"
 #include "Logger.h"
+#include "TieredJIT.h"
+#include "TimeReport.h"
 #include "Environment.h"
+#include "SymbolTable.h"
 
 using syntax::EvaParser;
 
 /**
- * Environment Type
+ * Class Info. Contains struct type, field names and vTable.
+ * Fields and methods are kept in declaration order (inherited first).
 */
-using Env = std::shared_ptr<Environment>;
+struct ClassInfo {
+    llvm::StructType* cls;
+    llvm::StructType* parent;
+    SymbolMap<llvm::Type*> fieldsMap;
+    SymbolMap<llvm::Function*> methodsMap;
+    llvm::StructType* vTableTy;
+    llvm::GlobalVariable* vTable;
+
+    /**
+     * Final class (no subclasses), and final methods (own and inherited)
+    */
+    bool isFinal;
+    std::set<Symbol> finalMethods;
+
+    /**
+     * Whether the program creates instances of the class (with `new`)
+    */
+    bool instantiated;
+
+    /**
+     * Layout for the precise GC: size and offsets of object fields
+    */
+    llvm::GlobalVariable* typeMap;
+};
 
 /**
- * Class Info. Contains struct type and field names
+ * Method call through a vTable, devirtualized once the class hierarchy is known.
 */
-struct ClassInfo {
+struct VirtualCall {
+    llvm::CallInst* call;
+    llvm::LoadInst* method;
     llvm::StructType* cls;
-    llvm::StructType* parent;
-    std::map<std::string, llvm::Type*> fieldsMap;
-    std::map<std::string, llvm::Function*> methodsMap;
+    Symbol methodName;
+};
+
+/**
+ * Imported file: its module is compiled once, and its top-level
+ * functions are defined in the scope of each import.
+*/
+struct ImportedFile {
+    llvm::Function* init;
+    std::vector<std::pair<Symbol, llvm::Value*>> exports;
+    bool compiled;
+};
+
+/**
+ * Output of the compiler
+*/
+enum class EmitKind {
+    LL,     // Textual IR
+    BC,     // Bitcode
+    OBJ,    // Native object file
+    EXE,    // Executable, linked with the GC runtime
+    NONE,   // Nothing (compile only, e.g. for the time report)
+};
+
+/**
+ * Garbage collector of the compiled program
+*/
+enum class GCKind {
+    BOEHM,      // Conservative (libgc's GC_malloc)
+    PRECISE,    // Generational, with stack maps (the Eva runtime, src/runtime)
+};
+
+/**
+ * Compiler options, set by the driver.
+*/
+struct CompilerOptions {
+    /**
+     * Source file of the program, imports are resolved relative to it
+     * (to the working directory if empty).
+    */
+    std::string sourceFile;
+
+    /**
+     * Output kind.
+    */
+    EmitKind emit = EmitKind::LL;
+
+    /**
+     * Output file, or empty for the default one in ./dist. "-" is stdout.
+    */
+    std::string outputFile;
+
+    /**
+     * Target CPU, "native" for the host CPU. By default generic for
+     * emitted code, and the host CPU for the JIT.
+    */
+    std::string cpu;
+
+    /**
+     * Target features, e.g. "+avx2,-avx512f" (added to the host's with --mcpu=native).
+    */
+    std::string features;
+
+    /**
+     * Garbage collector.
+    */
+    GCKind gc = GCKind::PRECISE;
+
+    /**
+     * GC runtime to link executables with, or empty for the default:
+     * -lgc for Boehm, libevagc.a next to the compiler for the precise GC.
+    */
+    std::string gcLib;
+
+    /**
+     * Run the program in-process with the JIT instead of emitting it.
+    */
+    bool jit = false;
+
+    /**
+     * Compile functions on their first call (otherwise the whole module
+     * is compiled before main runs).
+    */
+    bool lazyJit = true;
+
+    /**
+     * Run the JIT in two tiers: unoptimized code first, hot functions
+     * recompiled at the optimization level (O3 if not set).
+    */
+    bool tieredJit = false;
+
+    /**
+     * Calls and loop iterations after which a function is recompiled.
+    */
+    uint32_t tierUpThreshold = 1000;
+
+    /**
+     * Precompiled AST cache file, or empty if the cache is not used.
+    */
+    std::string astCachePath;
+
+    /**
+     * Object code cache directory of the functions, or empty if executables
+     * are built from scratch.
+    */
+    std::string incrementalCacheDir;
+
+    /**
+     * Number of partitions of the module which are optimized and compiled
+     * in parallel (--emit exe). 1 compiles the module as a whole.
+    */
+    unsigned codegenPartitions = 1;
+
+    /**
+     * Optimization level of the default pipeline. O0 runs no passes.
+    */
+    llvm::OptimizationLevel optLevel = llvm::OptimizationLevel::O0;
+
+    /**
+     * Custom pass pipeline (as in `opt -passes=...`), overrides the level.
+    */
+    std::string passPipeline;
+
+    /**
+     * Print the time report to stderr.
+    */
+    bool timeReport = false;
+
+    /**
+     * Write the time report as JSON to this file, if not empty.
+    */
+    std::string timeReportJsonPath;
 };
 
 /**
@@ -47,38 +256,393 @@ static const size_t VTABLE_INDEX = 0;
 */
 static const size_t RESERVED_FIELDS_COUNT = 1;
 
+/**
+ * Precise GC: objects are pointers of this address space (the GC heap of
+ * LLVM's statepoint example strategy), so they are relocated at calls.
+*/
+static const unsigned GC_ADDRESS_SPACE = 1;
+static const char* GC_STRATEGY = "statepoint-example";
+
 // Generic Binary Operator
 #define GEN_BINARY_OP(Op, varName)         \
   do {                                     \
-    auto op1 = gen(expr.list[1], env);      \
-    auto op2 = gen(expr.list[2], env);      \
+    auto op1 = gen(expr.list[1]);      \
+    auto op2 = gen(expr.list[2]);      \
     return builder->Op(op1, op2, varName); \
   } while (false);
 
 class EvaLLVM {
     public:
-        EvaLLVM() : parser(std::make_unique<EvaParser>()) { 
+        EvaLLVM(const CompilerOptions& options = {}) : options_(options), parser(std::make_unique<EvaParser>()) { 
             moduleInit(); 
             setupExternalFunctions();
             setupGlobalEnvironment();
             setupTargetTriple();
+            setupTargetMachine();
+            setupSpecialForms();
         }
     
-    void exec(const std::string& program) {
-        // 1. Parse the program
-        auto ast = parser->parse("(begin " + program + ")");
+    /**
+     * Compiles the program. Returns the exit code of the program
+     * when it is run with the JIT, otherwise EXIT_SUCCESS.
+    */
+    int exec(std::string_view program) {
+        if (options_.timeReport || !options_.timeReportJsonPath.empty()) {
+            timeReport_ = std::make_unique<TimeReport>();
+        }
+
+        // 1. Parse the program. The AST refers to the source, so it has to outlive the compilation
+        auto ast = parse(program);
+
+        if (timeReport_) {
+            timeReport_->setCount("AST nodes", countNodes(ast));
+        }
 
         // 2. Compile to LLVM IR
-        compile(ast);
-        
-        // Print Generated code
-        module->print(llvm::outs(), nullptr);
+        {
+            TimeReport::Phase phase(timeReport_.get(), "codegen");
+            compile(ast);
+        }
+
+        // Free the AST
+        parser->arena.clear();
 
-        // 3. Save module IR to file
-        saveModuleToFile("./dist/out.ll");
+        {
+            TimeReport::Phase phase(timeReport_.get(), "devirtualization");
+            devirtualize();
+        }
+
+        {
+            TimeReport::Phase phase(timeReport_.get(), "verification");
+            verifyModule();
+        }
+
+        // Imported files are kept as separate modules for ThinLTO,
+        // other outputs are built from the whole program
+        auto thinLTO = !importedModules_.empty() && options_.emit == EmitKind::EXE && !options_.jit &&
+                       options_.incrementalCacheDir.empty() && options_.codegenPartitions <= 1;
+
+        if (!importedModules_.empty() && !thinLTO) {
+            TimeReport::Phase phase(timeReport_.get(), "module linking");
+            linkImportedModules();
+        }
+
+        // 3. Optimize (the tiered JIT optimizes hot functions only,
+        // incremental and partitioned builds each unit, ThinLTO each file)
+        if (!thinLTO && !options_.tieredJit && options_.incrementalCacheDir.empty() && options_.codegenPartitions <= 1) {
+            TimeReport::Phase phase(timeReport_.get(), "optimization");
+            optimize(*module, options_.optLevel, targetMachine_.get());
+        }
+
+        // The JIT takes the module, so its statistics are collected before
+        if (timeReport_) {
+            countModule();
+        }
+
+        // 4. Run or output
+        int exitCode = EXIT_SUCCESS;
+
+        if (options_.jit) {
+            exitCode = runJIT();
+        } else {
+            emitOutput();
+        }
+
+        if (timeReport_) {
+            // Known once the optimizations ran (in the tiered JIT, so far)
+            timeReport_->setCount("stack-allocated objects", stackAllocatedObjects_);
+            printTimeReport();
+        }
+
+        return exitCode;
     }
 
     private:
+        /**
+         * Parses the program, or loads its AST from the cache if the program did not change.
+        */
+        Exp parse(std::string_view program) {
+            using namespace std::chrono;
+
+            Exp ast{ExpList{}};
+
+            if (!options_.astCachePath.empty()) {
+                TimeReport::Phase phase(timeReport_.get(), "AST cache load");
+                astCache_ = std::make_unique<AstCache>(options_.astCachePath);
+
+                auto start = steady_clock::now();
+
+                if (astCache_->load(program, parser->arena, ast)) {
+                    auto loadMicros = duration_cast<microseconds>(steady_clock::now() - start).count();
+                    auto parseMicros = (int64_t)astCache_->savedParseMicros();
+
+                    llvm::errs() << "AST cache hit: " << astCache_->path()
+                                 << llvm::format(" (loaded in %.2f ms, saved %.2f ms)\n",
+                                                 loadMicros / 1000.0, (parseMicros - loadMicros) / 1000.0);
+                    return ast;
+                }
+            }
+
+            // The parser lexes on demand, so lexing is measured by a separate pass
+            if (timeReport_) {
+                TimeReport::Phase phase(timeReport_.get(), "lexing");
+                timeReport_->setCount("tokens", countTokens(program));
+            }
+
+            auto start = steady_clock::now();
+
+            {
+                TimeReport::Phase phase(timeReport_.get(), "parsing");
+                ast = ParallelParser(*parser).parseProgram(program);
+            }
+
+            if (astCache_) {
+                TimeReport::Phase phase(timeReport_.get(), "AST cache save");
+                auto parseMicros = duration_cast<microseconds>(steady_clock::now() - start).count();
+
+                llvm::errs() << "AST cache miss: " << astCache_->path()
+                             << llvm::format(" (parsed in %.2f ms)\n", parseMicros / 1000.0);
+
+                if (!astCache_->save(program, ast, parseMicros)) {
+                    llvm::errs() << "Could not write the AST cache " << astCache_->path() << "\n";
+                }
+            }
+
+            return ast;
+        }
+
+        /**
+         * Verifies the generated modules.
+        */
+        void verifyModule() {
+            if (llvm::verifyModule(*module, &llvm::errs())) {
+                DIE << "Generated module is invalid.";
+            }
+
+            for (auto& imported : importedModules_) {
+                if (llvm::verifyModule(*imported, &llvm::errs())) {
+                    DIE << "Generated module of " << imported->getModuleIdentifier() << " is invalid.";
+                }
+            }
+        }
+
+        /**
+         * Links the modules of the imported files into the main module.
+        */
+        void linkImportedModules() {
+            for (auto& imported : importedModules_) {
+                if (llvm::Linker::linkModules(*module, std::move(imported))) {
+                    DIE << "Cannot link the imported files.";
+                }
+            }
+
+            importedModules_.clear();
+        }
+
+        /**
+         * Runs the optimization pipeline on a module in place. The target
+         * machine (if any) should not be used by other threads meanwhile.
+         * The ThinLTO pre-link pipeline leaves cross-module work to the
+         * thin link.
+        */
+        void optimize(llvm::Module& module, llvm::OptimizationLevel level, llvm::TargetMachine* machine,
+                      bool thinLTOPreLink = false) const {
+            if (options_.passPipeline.empty() && level == llvm::OptimizationLevel::O0) {
+                return;
+            }
+
+            runPasses(module, machine, [&](llvm::PassBuilder& passBuilder) {
+                // Escape analysis, after constructors are inlined (also "heap-to-stack" in custom pipelines)
+                passBuilder.registerPeepholeEPCallback([this](llvm::FunctionPassManager& functionPasses, llvm::OptimizationLevel) {
+                    functionPasses.addPass(HeapToStackPass(&stackAllocatedObjects_));
+                });
+
+                passBuilder.registerPipelineParsingCallback(
+                    [this](llvm::StringRef name, llvm::FunctionPassManager& functionPasses, llvm::ArrayRef<llvm::PassBuilder::PipelineElement>) {
+                        if (name != "heap-to-stack") {
+                            return false;
+                        }
+
+                        functionPasses.addPass(HeapToStackPass(&stackAllocatedObjects_));
+                        return true;
+                    });
+
+                llvm::ModulePassManager modulePasses;
+
+                if (!options_.passPipeline.empty()) {
+                    if (auto error = passBuilder.parsePassPipeline(modulePasses, options_.passPipeline)) {
+                        DIE << "Invalid pass pipeline \"" << options_.passPipeline << "\": " << llvm::toString(std::move(error));
+                    }
+                } else if (thinLTOPreLink) {
+                    modulePasses = passBuilder.buildThinLTOPreLinkDefaultPipeline(level);
+                } else {
+                    modulePasses = passBuilder.buildPerModuleDefaultPipeline(level);
+                }
+
+                return modulePasses;
+            });
+        }
+
+        /**
+         * Precise GC: rewrites the calls of the optimized module into
+         * statepoints, which relocate the live objects, for codegen.
+         * Objects in local variables are promoted to values first, and
+         * the nursery's fast path is inlined in allocations.
+        */
+        void lowerGC(llvm::Module& module, llvm::TargetMachine* machine) const {
+            if (options_.gc != GCKind::PRECISE) {
+                return;
+            }
+
+            runPasses(module, machine, [](llvm::PassBuilder&) {
+                llvm::ModulePassManager modulePasses;
+                modulePasses.addPass(llvm::createModuleToFunctionPassAdaptor(llvm::PromotePass()));
+                modulePasses.addPass(InlineAllocationPass());
+                modulePasses.addPass(llvm::RewriteStatepointsForGC());
+
+                return modulePasses;
+            });
+
+            // Objects left in memory would not be relocated: mem2reg only
+            // promotes allocas of the entry block
+            for (auto& function : module) {
+                for (auto& inst : llvm::instructions(function)) {
+                    auto alloca = llvm::dyn_cast<llvm::AllocaInst>(&inst);
+
+                    if (alloca != nullptr && holdsObjects(alloca->getAllocatedType())) {
+                        DIE << "[EvaLLVM]: Object variable " << alloca->getName().str() << " of "
+                            << function.getName().str() << " is not visible to the GC.";
+                    }
+                }
+            }
+        }
+
+        /**
+         * Whether values of a type hold object pointers (of the precise GC)
+        */
+        static bool holdsObjects(llvm::Type* type) {
+            if (type->isPointerTy()) {
+                return type->getPointerAddressSpace() == GC_ADDRESS_SPACE;
+            }
+
+            for (auto elementTy : type->subtypes()) {
+                if (holdsObjects(elementTy)) {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        /**
+         * Runs a pipeline of the new pass manager on a module.
+        */
+        void runPasses(llvm::Module& module, llvm::TargetMachine* machine,
+                       const std::function<llvm::ModulePassManager(llvm::PassBuilder&)>& buildPipeline) const {
+            llvm::LoopAnalysisManager loopAnalyses;
+            llvm::FunctionAnalysisManager functionAnalyses;
+            llvm::CGSCCAnalysisManager cgsccAnalyses;
+            llvm::ModuleAnalysisManager moduleAnalyses;
+
+            llvm::PassBuilder passBuilder(machine);
+
+            passBuilder.registerModuleAnalyses(moduleAnalyses);
+            passBuilder.registerCGSCCAnalyses(cgsccAnalyses);
+            passBuilder.registerFunctionAnalyses(functionAnalyses);
+            passBuilder.registerLoopAnalyses(loopAnalyses);
+            passBuilder.crossRegisterProxies(loopAnalyses, functionAnalyses, cgsccAnalyses, moduleAnalyses);
+
+            auto modulePasses = buildPipeline(passBuilder);
+            modulePasses.run(module, moduleAnalyses);
+        }
+
+        /**
+         * Runs the tokenizer over the program, returns the number of tokens.
+        */
+        static size_t countTokens(std::string_view program) {
+            syntax::Tokenizer tokenizer;
+            tokenizer.initProgram(program);
+
+            size_t count = 0;
+
+            while (tokenizer.getNextToken().type != syntax::TokenType::__EOF) {
+                count++;
+            }
+
+            return count;
+        }
+
+        /**
+         * Number of nodes of an AST.
+        */
+        static size_t countNodes(const Exp& exp) {
+            size_t count = 1;
+
+            if (exp.type == ExpType::LIST) {
+                for (auto& entry : exp.list) {
+                    count += countNodes(entry);
+                }
+            }
+
+            return count;
+        }
+
+        /**
+         * Records the statistics of the modules in the time report.
+        */
+        void countModule() {
+            size_t functions = 0;
+            size_t blocks = 0;
+            size_t instructions = 0;
+
+            std::vector<llvm::Module*> modules{module.get()};
+
+            for (auto& imported : importedModules_) {
+                modules.push_back(imported.get());
+            }
+
+            for (auto fileModule : modules) {
+                for (auto& function : *fileModule) {
+                    if (function.isDeclaration()) {
+                        continue;
+                    }
+
+                    functions++;
+
+                    for (auto& block : function) {
+                        blocks++;
+                        instructions += block.size();
+                    }
+                }
+            }
+
+            timeReport_->setCount("functions", functions);
+            timeReport_->setCount("basic blocks", blocks);
+            timeReport_->setCount("instructions", instructions);
+            timeReport_->setCount("devirtualized calls", devirtualizedCalls_);
+            timeReport_->setCount("speculative calls", speculativeCalls_);
+        }
+
+        /**
+         * Prints the time report and writes its JSON.
+        */
+        void printTimeReport() {
+            if (options_.timeReport) {
+                timeReport_->print(llvm::errs());
+            }
+
+            if (!options_.timeReportJsonPath.empty()) {
+                std::error_code errorCode;
+                llvm::raw_fd_ostream out(options_.timeReportJsonPath, errorCode);
+
+                if (errorCode) {
+                    DIE << "Cannot write the time report to " << options_.timeReportJsonPath << ": " << errorCode.message();
+                }
+
+                timeReport_->printJSON(out);
+            }
+        }
+
         /**
          * Compiles an expression
         */
@@ -89,14 +653,20 @@ class EvaLLVM {
                 llvm::FunctionType::get(
                     /* return type */ builder->getInt32Ty(),
                     /* vararg */ false
-                ),
-                GlobalEnv
+                )
             );
 
             createGlobalVar("VERSION", builder->getInt32(42))->getInitializer();
 
+            // The program file itself can't be imported (that is a cycle)
+            if (!options_.sourceFile.empty()) {
+                currentFile_ = resolveImport(options_.sourceFile);
+                imports_[currentFile_].compiled = false;
+            }
+
             // 2. Compile main body
-            gen(ast, GlobalEnv);
+            fileInit_ = fn;
+            gen(ast);
 
             builder->CreateRet(builder->getInt32(0));
         }
@@ -104,7 +674,7 @@ class EvaLLVM {
         /**
          * Main Compile Loop
         */
-        llvm::Value* gen(const Exp& expr, Env env) {
+        llvm::Value* gen(const Exp& expr) {
             switch (expr.type) {
                 // Numbers
                 case ExpType::NUMBER: {
@@ -113,478 +683,919 @@ class EvaLLVM {
 
                 // Strings
                 case ExpType::STRING: {
-                    // Unescape all special characters. TODO: support all chars or handle in parser
-                    auto re = std::regex("\\\\n");
-                    auto str = std::regex_replace(expr.string, re, "\n");
-
-                    return builder->CreateGlobalStringPtr(str);
+                    return builder->CreateGlobalStringPtr(unescape(expr.string));
                 }
                 
                 // Symbols
                 case ExpType::SYMBOL: {
                     // Boolean
-                    if (expr.string == "true" || expr.string == "false") {
-                        return builder->getInt1(expr.string == "true" ? true : false);
+                    if (expr.symbol == KW_TRUE || expr.symbol == KW_FALSE) {
+                        return builder->getInt1(expr.symbol == KW_TRUE ? true : false);
                     } else {
                         // Variables
                         auto varName = expr.string;
-                        auto value = env->lookup(varName);
+                        auto value = env.lookup(expr.symbol);
 
                         // 1. Local Variables
                         if (auto localVar = llvm::dyn_cast<llvm::AllocaInst>(value)) {
-                            return builder->CreateLoad(localVar->getAllocatedType(), localVar, varName.c_str());
+                            return builder->CreateLoad(localVar->getAllocatedType(), localVar, varName);
                         }
 
                         // 2. Global Variables
                         else if (auto globalVar = llvm::dyn_cast<llvm::GlobalVariable>(value)) {
-                            return builder->CreateLoad(globalVar->getInitializer()->getType(), globalVar, varName.c_str());
+                            return builder->CreateLoad(globalVar->getValueType(), localize(globalVar), varName);
                         }
 
                         // 3. Functions
                         else {
-                            return value;
+                            return localize(value);
                         }
                     }
                 }
                 
                 // Lists
                 case ExpType::LIST: {
-                    auto tag = expr.list[0];
+                    const auto& tag = expr.list[0];
 
                     // Special Cases
                     if (tag.type == ExpType::SYMBOL) {
-                        auto op = tag.string;
-
-                        // Binary Math Operations:
-                        if (op == "+") {
-                            GEN_BINARY_OP(CreateAdd, "tmpadd");
-                        }
-                        else if (op == "-") {
-                            GEN_BINARY_OP(CreateSub, "tmpsub")
-                        }
-                        else if (op == "*") {
-                            GEN_BINARY_OP(CreateMul, "tmpmul");
-                        }
-                        else if (op == "/") {
-                            GEN_BINARY_OP(CreateSDiv, "tmpdiv");
-                        }
-
-                        // Comparison Operations (> 5 10):
-                        else if (op == ">") {
-                            GEN_BINARY_OP(CreateICmpUGT, "tmpcmp");
-                        }
-                        else if (op == "<") {
-                            GEN_BINARY_OP(CreateICmpULT, "tmpcmp");
-                        }
-                        else if (op == "==") {
-                            GEN_BINARY_OP(CreateICmpEQ, "tmpcmp");
-                        }
-                        else if (op == "!=") {
-                            GEN_BINARY_OP(CreateICmpNE, "tmpcmp");
-                        }
-                        else if (op == ">=") {
-                            GEN_BINARY_OP(CreateICmpUGE, "tmpcmp");
-                        }
-                        else if (op == "<=") {
-                            GEN_BINARY_OP(CreateICmpULE, "tmpcmp");
+                        // Special forms are dispatched by the keyword ID
+                        if (tag.symbol < KEYWORDS_COUNT && specialForms_[tag.symbol] != nullptr) {
+                            return (this->*specialForms_[tag.symbol])(expr);
                         }
 
-                        // Branch Instructions:
-                        /**
-                         * (if <cond> <then> <else>)
-                        */
-                        else if (op == "if") {
-                            // Compile <cond>
-                            auto cond = gen(expr.list[1], env);
+                        // Function calls: (square 2)
+                        return genCall(expr);
+                    }
 
-                            // Branch Blocks:
+                    // Method Calls: ((method p getX) 2)
+                    else {
+                        return genMethodCall(expr);
+                    }
+                }
+            }
 
-                            // Then-block appeneded right away
-                            auto thenBlock = createBasicBlock("then", fn);
+            return builder->getInt32(0);
+        }
 
-                            // Else-IfEnd blocks are appended later to handle nested if-expressions
-                            auto elseBlock = createBasicBlock("else");
-                            auto ifEndBlock = createBasicBlock("ifend");
+        // Binary Math Operations:
+        llvm::Value* genAdd(const Exp& expr) { GEN_BINARY_OP(CreateAdd, "tmpadd"); }
+        llvm::Value* genSub(const Exp& expr) { GEN_BINARY_OP(CreateSub, "tmpsub"); }
+        llvm::Value* genMul(const Exp& expr) { GEN_BINARY_OP(CreateMul, "tmpmul"); }
+        llvm::Value* genDiv(const Exp& expr) { GEN_BINARY_OP(CreateSDiv, "tmpdiv"); }
 
-                            // Condition Branch:
-                            builder->CreateCondBr(cond, thenBlock, elseBlock);
+        // Comparison Operations (> 5 10):
+        llvm::Value* genGt(const Exp& expr) { GEN_BINARY_OP(CreateICmpUGT, "tmpcmp"); }
+        llvm::Value* genLt(const Exp& expr) { GEN_BINARY_OP(CreateICmpULT, "tmpcmp"); }
+        llvm::Value* genEq(const Exp& expr) { GEN_BINARY_OP(CreateICmpEQ, "tmpcmp"); }
+        llvm::Value* genNe(const Exp& expr) { GEN_BINARY_OP(CreateICmpNE, "tmpcmp"); }
+        llvm::Value* genGe(const Exp& expr) { GEN_BINARY_OP(CreateICmpUGE, "tmpcmp"); }
+        llvm::Value* genLe(const Exp& expr) { GEN_BINARY_OP(CreateICmpULE, "tmpcmp"); }
 
-                            // Then branch:
-                            builder->SetInsertPoint(thenBlock);
-                            auto thenRes = gen(expr.list[2], env);
-                            builder->CreateBr(ifEndBlock);
+        /**
+         * Branch Instructions: (if <cond> <then> <else>)
+        */
+        llvm::Value* genIf(const Exp& expr) {
+            // Compile <cond>
+            auto cond = gen(expr.list[1]);
 
-                            // Result the block to handle nested if-expressions. This is needed for the `phi` instruction
-                            thenBlock = builder->GetInsertBlock();
+            // Branch Blocks:
 
-                            // Else branch:
-                            // Append the block to the function now:
-                            fn->getBasicBlockList().push_back(elseBlock);
-                            builder->SetInsertPoint(elseBlock);
-                            auto elseRes = gen(expr.list[3], env);
-                            builder->CreateBr(ifEndBlock);
-                            
-                            elseBlock = builder->GetInsertBlock();
+            // Then-block appeneded right away
+            auto thenBlock = createBasicBlock("then", fn);
 
-                            // Once the two blocks have finished, Head to the ending block
-                            fn->getBasicBlockList().push_back(ifEndBlock);
-                            builder->SetInsertPoint(ifEndBlock);
+            // Else-IfEnd blocks are appended later to handle nested if-expressions
+            auto elseBlock = createBasicBlock("else");
+            auto ifEndBlock = createBasicBlock("ifend");
 
-                            // Result of the If expression is `phi` instruction
-                            auto phi = builder->CreatePHI(thenRes->getType(), 2, "tmpif");
+            // Condition Branch:
+            builder->CreateCondBr(cond, thenBlock, elseBlock);
 
-                            phi->addIncoming(thenRes, thenBlock);
-                            phi->addIncoming(elseRes, elseBlock);
+            // Then branch:
+            builder->SetInsertPoint(thenBlock);
+            auto thenRes = gen(expr.list[2]);
+            builder->CreateBr(ifEndBlock);
 
-                            return phi;
-                        }
+            // Result the block to handle nested if-expressions. This is needed for the `phi` instruction
+            thenBlock = builder->GetInsertBlock();
 
-                        // While Loop (while <cond> <body>)
-                        else if (op == "while") {
-                            auto condBlock = createBasicBlock("cond", fn);
-                            builder->CreateBr(condBlock);
+            // Else branch:
+            // Append the block to the function now:
+            fn->getBasicBlockList().push_back(elseBlock);
+            builder->SetInsertPoint(elseBlock);
+            auto elseRes = gen(expr.list[3]);
+            builder->CreateBr(ifEndBlock);
+            
+            elseBlock = builder->GetInsertBlock();
 
-                            // Body / While-End blocks
-                            auto bodyBlock = createBasicBlock("body");
-                            auto loopEndBlock = createBasicBlock("loopend");
+            // Once the two blocks have finished, Head to the ending block
+            fn->getBasicBlockList().push_back(ifEndBlock);
+            builder->SetInsertPoint(ifEndBlock);
 
-                            // Compile <cond>
-                            builder->SetInsertPoint(condBlock);
-                            auto cond = gen(expr.list[1], env);
+            // Result of the If expression is `phi` instruction
+            auto phi = builder->CreatePHI(thenRes->getType(), 2, "tmpif");
 
-                            // Condition branch
-                            builder->CreateCondBr(cond, bodyBlock, loopEndBlock);
+            phi->addIncoming(thenRes, thenBlock);
+            phi->addIncoming(elseRes, elseBlock);
 
-                            // Body
-                            fn->getBasicBlockList().push_back(bodyBlock);
-                            builder->SetInsertPoint(bodyBlock);
-                            gen(expr.list[2], env);
-                            builder->CreateBr(condBlock);
+            return phi;
+        }
 
-                            fn->getBasicBlockList().push_back(loopEndBlock);
-                            builder->SetInsertPoint(loopEndBlock);
+        /**
+         * While Loop (while <cond> <body>)
+        */
+        llvm::Value* genWhile(const Exp& expr) {
+            auto condBlock = createBasicBlock("cond", fn);
+            builder->CreateBr(condBlock);
 
-                            return builder->getInt32(0);
-                        }
+            // Body / While-End blocks
+            auto bodyBlock = createBasicBlock("body");
+            auto loopEndBlock = createBasicBlock("loopend");
 
-                        // Function Declaration: (def <name> <params> <body>)
-                        else if (op == "def") {
-                            return compileFunction(expr, /* name */ expr.list[1].string, env);
-                        }
+            // Compile <cond>
+            builder->SetInsertPoint(condBlock);
+            auto cond = gen(expr.list[1]);
 
-                        // Variable declaration: (var x (+ y 10))
-                        // Typed: (var (x number) 42)
-                        // Note: Locals are allocated on the stack
-                        if (op == "var") {
-                            // Special case for class fields, which are already defined during class info allocation:
-                            if (cls != nullptr) {
-                                return builder->getInt32(0);
-                            }
+            // Condition branch
+            builder->CreateCondBr(cond, bodyBlock, loopEndBlock);
 
-                            auto varNameDecl = expr.list[1];
-                            auto varName = extractVarName(varNameDecl);
+            // Body
+            fn->getBasicBlockList().push_back(bodyBlock);
+            builder->SetInsertPoint(bodyBlock);
+            gen(expr.list[2]);
+            builder->CreateBr(condBlock);
 
-                            // Special case for `new` as it allocates a variable:
-                            if (isNew(expr.list[2])) {
-                                auto instance = createInstance(expr.list[2], env, varName);
-                                return env->define(varName, instance);
-                            }
+            fn->getBasicBlockList().push_back(loopEndBlock);
+            builder->SetInsertPoint(loopEndBlock);
 
-                            // Initializer
-                            auto init = gen(expr.list[2], env);
+            return builder->getInt32(0);
+        }
 
-                            // Type:
-                            auto varTy = extractVarType(varNameDecl);
+        /**
+         * Function Declaration: (def <name> <params> <body>)
+        */
+        llvm::Value* genDef(const Exp& expr) {
+            auto function = compileFunction(expr, /* name */ expr.list[1].symbol);
 
-                            // Variable:
-                            auto varBinding = allocVar(varName, varTy, env);
+            // Top-level functions of imported files are exported
+            if (fileExports_ != nullptr && fn == fileInit_ && cls == nullptr) {
+                fileExports_->emplace_back(expr.list[1].symbol, function);
+            }
 
-                            // Set Value:
-                            return builder->CreateStore(init, varBinding);
-                        }
+            return function;
+        }
 
-                        // Variable update: (set x 100)
-                        // Property update: (set (prop self x) 100)
-                        else if (op == "set") {
-                            // Value:
-                            auto value = gen(expr.list[2], env);
-                            
-                            // 1. Properties
+        /**
+         * Variable declaration: (var x (+ y 10))
+         * Typed: (var (x number) 42)
+         * Note: Locals are allocated on the stack
+        */
+        llvm::Value* genVar(const Exp& expr) {
+            // Special case for class fields, which are already defined during class info allocation:
+            if (cls != nullptr) {
+                return builder->getInt32(0);
+            }
 
-                            // Special case for property writes:
-                            if (isProp(expr.list[1])) {
-                                auto instance = gen(expr.list[1].list[1], env);
-                                auto fieldName = expr.list[1].list[2].string;
-                                auto ptrName = std::string("p") + fieldName;
+            const auto& varNameDecl = expr.list[1];
+            auto varName = extractVarName(varNameDecl);
 
-                                auto cls = (llvm::StructType*)(instance->getType()->getContainedType(0));
-                                auto fieldIdx = getFieldIndex(cls, fieldName);
-                                auto address = builder->CreateStructGEP(cls, instance, fieldIdx, ptrName);
+            // Special case for `new` as it allocates a variable:
+            if (isNew(expr.list[2])) {
+                auto instance = createInstance(expr.list[2], symbols().name(varName));
+                return env.define(varName, instance);
+            }
 
-                                builder->CreateStore(value, address);
+            // Initializer
+            auto init = gen(expr.list[2]);
 
-                                return value;
-                            }
+            // Type:
+            auto varTy = extractVarType(varNameDecl);
 
-                            // 2. Variables
-                            else {
-                                auto varName = expr.list[1].string;
+            // Variable:
+            auto varBinding = allocVar(varName, varTy);
 
-                                // Variable:
-                                auto varBinding = env->lookup(varName);
+            // Set Value:
+            return builder->CreateStore(init, varBinding);
+        }
 
-                                // Set value:
-                                builder->CreateStore(value, varBinding);
+        /**
+         * Variable update: (set x 100)
+         * Property update: (set (prop self x) 100)
+        */
+        llvm::Value* genSet(const Exp& expr) {
+            // Value:
+            auto value = gen(expr.list[2]);
+            
+            // 1. Properties
 
-                                return value;
-                            }
-                        }
+            // Special case for property writes:
+            if (isProp(expr.list[1])) {
+                auto instance = gen(expr.list[1].list[1]);
+                const auto& field = expr.list[1].list[2];
 
-                        // Blocks: (begin <expression>)
-                        else if (op == "begin") {
-                            // Block scope
-                            auto blockEnv = std::make_shared<Environment>(std::map<std::string, llvm::Value*>{}, env);
+                auto cls = (llvm::StructType*)(instance->getType()->getContainedType(0));
+                auto fieldIdx = getFieldIndex(cls, field.symbol);
+                auto address = builder->CreateStructGEP(cls, instance, fieldIdx, "p" + llvm::Twine(field.string));
 
-                            // Compile each expression within the block.
-                            // Result is the last evaluated expression.
-                            llvm::Value* blockRes;
+                builder->CreateStore(value, address);
 
-                            for (auto i = 1; i < expr.list.size(); i++) {
-                                // Generate the expression code.
-                                blockRes = gen(expr.list[i], blockEnv);
-                            }
+                // The precise GC remembers old objects referring to young ones
+                if (options_.gc == GCKind::PRECISE && value->getType()->isPointerTy() &&
+                    value->getType()->getPointerAddressSpace() == GC_ADDRESS_SPACE) {
+                    builder->CreateCall(gcWriteBarrierFn, builder->CreatePointerCast(instance, gcWriteBarrierFn->getArg(0)->getType()));
+                }
 
-                            return blockRes;
-                        }
+                return value;
+            }
 
-                        // printf external function
-                        // ( printf "Value: %d" 42)
-                        else if (op == "printf") {
-                            auto printfFn = module->getFunction("printf");
+            // 2. Variables
+            else {
+                // Variable:
+                auto varBinding = localize(env.lookup(expr.list[1].symbol));
 
-                            std::vector<llvm::Value*> args{};
+                // Set value:
+                builder->CreateStore(value, varBinding);
 
-                            for (auto i = 1; i < expr.list.size(); i++) {
-                                args.push_back(gen(expr.list[i], env));
-                            }
+                return value;
+            }
+        }
 
-                            return builder->CreateCall(printfFn, args);
-                        }
+        /**
+         * Blocks: (begin <expression>)
+        */
+        llvm::Value* genBegin(const Exp& expr) {
+            // Block scope
+            Environment::Scope blockScope(env);
 
-                        // Class Declaration: (class A <super> <body>)
-                        else if (op == "class") {
-                            auto name = expr.list[1].string;
-
-                            auto parent = expr.list[2].string == "null" ? nullptr : getClassByName(expr.list[2].string);
-
-                            // Currently compiling class
-                            cls = llvm::StructType::create(*ctx, name);
-
-                            // Super class data always sits at the first element
-                            if (parent != nullptr) {
-                                inheritClass(cls, parent);
-                            } else {
-                                classMap_[name] = {
-                                    /* class */ cls,
-                                    /* parent */ parent,
-                                    /* fields */ {},
-                                    /* methods */ {}
-                                };
-                            }
+            // Compile each expression within the block.
+            // Result is the last evaluated expression.
+            llvm::Value* blockRes;
 
-                            // Populate the class info with fields and methods
-                            buildClassInfo(cls, expr, env);
+            for (size_t i = 1; i < expr.list.size(); i++) {
+                // Generate the expression code.
+                blockRes = gen(expr.list[i]);
+            }
 
-                            // Compile the body:
-                            gen(expr.list[3], env);
+            return blockRes;
+        }
 
-                            // Reset the class variable after compiling so normal functions do not pick the class name prefix
-                            cls = nullptr;
+        /**
+         * printf external function
+         * ( printf "Value: %d" 42)
+        */
+        llvm::Value* genPrintf(const Exp& expr) {
+            std::vector<llvm::Value*> args{};
 
-                            return builder->getInt32(0);
-                        }
+            for (size_t i = 1; i < expr.list.size(); i++) {
+                args.push_back(gen(expr.list[i]));
+            }
 
-                        // `new` Operator: (new <class> <args>)
-                        else if (op == "new") {
-                            return createInstance(expr, env, "");
-                        }
+            return builder->CreateCall(printfFn, args);
+        }
 
-                        // Prop access: (prop <instance> <name>)
-                        else if (op == "prop") {
-                            // Instance
-                            auto instance = gen(expr.list[1], env);
-                            auto fieldName = expr.list[2].string;
-                            auto ptrName = std::string("p") + fieldName;
+        /**
+         * Class Declaration: (class A <super> <body>)
+        */
+        llvm::Value* genClass(const Exp& expr) {
+            return compileClass(expr, /* isFinal */ false);
+        }
 
-                            auto cls = (llvm::StructType*)(instance->getType()->getContainedType(0));
+        /**
+         * Final marker: (final (class ...)), or (final (def ...)) in a class body.
+         *
+         * Final classes can't be inherited and final methods can't be
+         * overridden, so their calls are bound statically.
+        */
+        llvm::Value* genFinal(const Exp& expr) {
+            const auto& decl = expr.list[1];
 
-                            auto fieldIdx = getFieldIndex(cls, fieldName);
+            if (isTaggedList(decl, KW_CLASS)) {
+                return compileClass(decl, /* isFinal */ true);
+            }
 
-                            auto address = builder->CreateStructGEP(cls, instance, fieldIdx, ptrName);
+            // Final methods are recorded in the class info
+            if (isDef(decl) && cls != nullptr) {
+                return genDef(decl);
+            }
 
-                            return builder->CreateLoad(cls->getElementType(fieldIdx), address, fieldName);
-                        }
+            DIE << "[EvaLLVM]: Only classes and methods can be final";
+            return builder->getInt32(0);
+        }
 
-                        // Method access: (method <instance> <name>) | (method (super <class>) <name>)
-                        else if (op == "method") {
-                            auto methodName = expr.list[2].string;
-
-                            llvm::StructType* cls;
-                            llvm::Value* vTable;
-                            llvm::StructType* vTableTy;
-                            
-                            // 1. Load vTable
-                            // (method (super <class>) <name>)
-                            if (isSuper(expr.list[1])) {
-                                auto className = expr.list[1].list[1].string;
-                                cls = classMap_[className].parent;
-                                auto parentName = std::string{cls->getName().data()};
-                                vTable = module->getNamedGlobal(parentName + "_vTable");
-                                vTableTy = llvm::StructType::getTypeByName(*ctx, parentName + "_vTable");
-                            }
+        /**
+         * Compiles a class declaration
+        */
+        llvm::Value* compileClass(const Exp& expr, bool isFinal) {
+            auto name = expr.list[1].symbol;
 
-                            // (method <instance> <name>)
-                            else {
-                                auto instance = gen(expr.list[1], env);
+            auto parent = expr.list[2].symbol == KW_NULL ? nullptr : getClassByName(expr.list[2].symbol);
 
-                                cls = (llvm::StructType*)(instance->getType()->getContainedType(0));
+            if (parent != nullptr && getClassInfo(parent)->isFinal) {
+                DIE << "[EvaLLVM]: Class " << expr.list[1].string << " inherits from final class " << expr.list[2].string;
+            }
 
-                                auto vTableAddr = builder->CreateStructGEP(cls, instance, VTABLE_INDEX);
-                                
-                                vTable = builder->CreateLoad(cls->getElementType(VTABLE_INDEX), vTableAddr, "vt");
+            // Currently compiling class
+            cls = llvm::StructType::create(*ctx, expr.list[1].string);
+
+            // Super class data always sits at the first element
+            if (parent != nullptr) {
+                inheritClass(name, cls, parent);
+            } else {
+                classMap_[name] = {
+                    /* class */ cls,
+                    /* parent */ parent,
+                    /* fields */ {},
+                    /* methods */ {},
+                    /* vTable type */ nullptr,
+                    /* vTable */ nullptr,
+                    /* final */ false,
+                    /* final methods */ {},
+                    /* instantiated */ false,
+                    /* type map */ nullptr
+                };
+            }
 
-                                vTableTy = (llvm::StructType*)(vTable->getType()->getContainedType(0));
-                            }
+            classMap_[name].isFinal = isFinal;
+            classByType_[cls] = &classMap_[name];
 
-                            // 2. Load method from vTable
-                            auto methodIdx = getMethodIndex(cls, methodName);
-                            auto methodTy = (llvm::FunctionType*)vTableTy->getElementType(methodIdx);
-                            auto methodAddr = builder->CreateStructGEP(vTableTy, vTable, methodIdx);
+            // Populate the class info with fields and methods
+            buildClassInfo(cls, expr);
 
-                            return builder->CreateLoad(methodTy, methodAddr);
-                        }
+            // Compile the body:
+            gen(expr.list[3]);
 
-                        // Function calls: (square 2)
-                        else {
-                            auto callable = gen(expr.list[0], env);
+            // Reset the class variable after compiling so normal functions do not pick the class name prefix
+            cls = nullptr;
 
-                            // Either a raw function or a functor (callable class):
-                            auto callableTy = callable->getType()->getContainedType(0);   
+            return builder->getInt32(0);
+        }
 
-                            std::vector<llvm::Value*> args{};
-                            auto argIdx = 0;
+        /**
+         * `new` Operator: (new <class> <args>)
+        */
+        llvm::Value* genNew(const Exp& expr) {
+            return createInstance(expr, "");
+        }
 
-                            // Callable classes:
-                            if (callableTy->isStructTy()) {
-                                auto cls = (llvm::StructType*)callableTy;
+        /**
+         * Prop access: (prop <instance> <name>)
+        */
+        llvm::Value* genProp(const Exp& expr) {
+            // Instance
+            auto instance = gen(expr.list[1]);
+            const auto& field = expr.list[2];
 
-                                std::string className{cls->getName().data()};
+            auto cls = (llvm::StructType*)(instance->getType()->getContainedType(0));
 
-                                // Push the factor itself as the first `self` arg:
-                                args.push_back(callable);
-                                argIdx++;  // and skip this argument
+            auto fieldIdx = getFieldIndex(cls, field.symbol);
 
-                                // TODO: support inheritance (load method from vTable)
-                                callable = module->getFunction(className + "___call__");  // Note 3 underscores
-                            }
+            auto address = builder->CreateStructGEP(cls, instance, fieldIdx, "p" + llvm::Twine(field.string));
 
-                            auto fn = (llvm::Function*)callable;
+            return builder->CreateLoad(cls->getElementType(fieldIdx), address, field.string);
+        }
 
-                            for (auto i = 1; i < expr.list.size(); i++, argIdx++) {
-                                auto argValue = gen(expr.list[i], env);
+        /**
+         * Method access: (method <instance> <name>) | (method (super <class>) <name>)
+        */
+        llvm::Value* genMethod(const Exp& expr) {
+            auto methodName = expr.list[2].symbol;
 
-                                // Need to cast to parameter type to support sub-classes:
-                                // We should be able to pass Point3D instance for the type of the parent class Point
-                                auto paramTy = fn->getArg(argIdx)->getType();
+            // (method (super <class>) <name>)
+            if (isSuper(expr.list[1])) {
+                auto className = expr.list[1].list[1].symbol;
+                auto cls = getClassInfoByName(className)->parent;
 
-                                auto bitCastArgVal = builder->CreateBitCast(argValue, paramTy);
-                                args.push_back(bitCastArgVal);
-                            }
+                return loadMethod(localize(getClassInfo(cls)->vTable), cls, methodName);
+            }
 
-                            return builder->CreateCall(fn, args);
-                        }
+            // (method <instance> <name>)
+            auto instance = gen(expr.list[1]);
+            auto cls = (llvm::StructType*)(instance->getType()->getContainedType(0));
+
+            return loadMethod(loadVTable(instance, cls), cls, methodName);
+        }
+
+        /**
+         * Loads the vTable of an instance
+        */
+        llvm::Value* loadVTable(llvm::Value* instance, llvm::StructType* cls) {
+            auto vTableAddr = builder->CreateStructGEP(cls, instance, VTABLE_INDEX);
+
+            return builder->CreateLoad(cls->getElementType(VTABLE_INDEX), vTableAddr, "vt");
+        }
+
+        /**
+         * Loads a method from a vTable of the class
+        */
+        llvm::LoadInst* loadMethod(llvm::Value* vTable, llvm::StructType* cls, Symbol methodName) {
+            auto vTableTy = getClassInfo(cls)->vTableTy;
+            auto methodIdx = getMethodIndex(cls, methodName);
+            auto methodTy = vTableTy->getElementType(methodIdx);
+            auto methodAddr = builder->CreateStructGEP(vTableTy, vTable, methodIdx);
+            auto method = builder->CreateLoad(methodTy, methodAddr);
+
+            // vTables are constant
+            method->setMetadata(llvm::LLVMContext::MD_invariant_load, llvm::MDNode::get(*ctx, {}));
+
+            return method;
+        }
+
+        /**
+         * Function calls: (square 2)
+        */
+        llvm::Value* genCall(const Exp& expr) {
+            auto callable = gen(expr.list[0]);
+
+            // Either a raw function or a functor (callable class):
+            auto callableTy = callable->getType()->getContainedType(0);   
+
+            std::vector<llvm::Value*> args{};
+            auto argIdx = 0;
+
+            // Callable classes:
+            if (callableTy->isStructTy()) {
+                auto cls = (llvm::StructType*)callableTy;
+
+                // Push the factor itself as the first `self` arg:
+                args.push_back(callable);
+                argIdx++;  // and skip this argument
+
+                // TODO: support inheritance (load method from vTable)
+                callable = localize(getMethod(cls, KW_CALL));
+            }
+
+            auto fn = (llvm::Function*)callable;
+
+            for (size_t i = 1; i < expr.list.size(); i++, argIdx++) {
+                auto argValue = gen(expr.list[i]);
+
+                // Need to cast to parameter type to support sub-classes:
+                // We should be able to pass Point3D instance for the type of the parent class Point
+                auto paramTy = fn->getArg(argIdx)->getType();
+
+                auto bitCastArgVal = builder->CreateBitCast(argValue, paramTy);
+                args.push_back(bitCastArgVal);
+            }
+
+            return builder->CreateCall(fn, args);
+        }
+
+        /**
+         * Method Calls: ((method p getX) 2)
+         *
+         * Super calls and methods of final classes, or final methods, are
+         * called directly. Other calls go through the vTable, and are
+         * devirtualized once all classes are known (see devirtualize).
+        */
+        llvm::Value* genMethodCall(const Exp& expr) {
+            const auto& method = expr.list[0];
+
+            if (!isTaggedList(method, KW_METHOD)) {
+                DIE << "[EvaLLVM]: Expected a method call: ((method <instance> <name>) <args>)";
+            }
+
+            auto methodName = method.list[2].symbol;
+
+            // 1. Statically bound calls
+            if (isSuper(method.list[1])) {
+                auto parent = getClassInfoByName(method.list[1].list[1].symbol)->parent;
+                auto target = localize(getMethod(parent, methodName));
+
+                return createMethodCall(target->getFunctionType(), target, expr);
+            }
+
+            auto instance = gen(method.list[1]);
+            auto cls = (llvm::StructType*)(instance->getType()->getContainedType(0));
+            auto classInfo = getClassInfo(cls);
+
+            if (classInfo->isFinal || classInfo->finalMethods.count(methodName) != 0) {
+                auto target = localize(getMethod(cls, methodName));
+                devirtualizedCalls_++;
+
+                return createMethodCall(target->getFunctionType(), target, expr);
+            }
+
+            // 2. Virtual calls
+            auto loadedMethod = loadMethod(loadVTable(instance, cls), cls, methodName);
+            auto fnTy = (llvm::FunctionType*)loadedMethod->getType()->getContainedType(0);
+            auto call = createMethodCall(fnTy, loadedMethod, expr);
+
+            virtualCalls_.push_back({call, loadedMethod, cls, methodName});
+
+            return call;
+        }
+
+        /**
+         * Calls a method with the arguments of a method call expression
+        */
+        llvm::CallInst* createMethodCall(llvm::FunctionType* fnTy, llvm::Value* callee, const Exp& expr) {
+            std::vector<llvm::Value*> args{};
+
+            for (size_t i = 1; i < expr.list.size(); i++) {
+                auto argValue = gen(expr.list[i]);
+
+                // Need to cast to parameter type to support sub-classes:
+                // We should be able to pass Point3D instance for the type of the parent class Point
+                auto paramTy = fnTy->getParamType(i - 1);
+
+                if (argValue->getType() != paramTy) {
+                    auto bitCastArgVal = builder->CreateBitCast(argValue, paramTy);
+                    args.push_back(bitCastArgVal);
+                } else {
+                    args.push_back(argValue);
+                }
+            }
+
+            return builder->CreateCall(fnTy, callee, args);
+        }
+
+        /**
+         * Devirtualizes the method calls through vTables by class hierarchy
+         * analysis, once the whole program is compiled (a class may be
+         * subclassed after its methods are called, e.g. in an importing file).
+         *
+         * The possible targets of a call are the implementations of the
+         * method in the instantiated classes among the receiver's static
+         * class and its subclasses (instances are only created with `new`):
+         *
+         *   - One target: the call is direct.
+         *
+         *   - Several targets: the call is speculated to the implementation of
+         *     the static class, if it is instantiated. The loaded method is
+         *     compared with it, and called directly (inlinable) if equal,
+         *     or through the vTable otherwise.
+        */
+        void devirtualize() {
+            if (virtualCalls_.empty()) {
+                return;
+            }
+
+            // Class hierarchy
+            std::map<llvm::StructType*, std::vector<ClassInfo*>> subclasses;
+
+            for (auto& entry : classMap_) {
+                if (entry.second.parent != nullptr) {
+                    subclasses[entry.second.parent].push_back(&entry.second);
+                }
+            }
+
+            for (auto& site : virtualCalls_) {
+                std::vector<llvm::Function*> targets;
+                std::vector<ClassInfo*> classes{getClassInfo(site.cls)};
+
+                while (!classes.empty()) {
+                    auto classInfo = classes.back();
+                    classes.pop_back();
+
+                    auto target = *classInfo->methodsMap.find(site.methodName);
+
+                    if (classInfo->instantiated && std::find(targets.begin(), targets.end(), target) == targets.end()) {
+                        targets.push_back(target);
                     }
 
-                    // Method Calls: ((method p getX) 2)
-                    else {
-                        auto loadedMethod = (llvm::LoadInst*)gen(expr.list[0], env);
-                        auto fnTy = (llvm::FunctionType*)(loadedMethod->getPointerOperand()
-                                        ->getType()
-                                        ->getContainedType(0)
-                                        ->getContainedType(0));
-                        
-                        std::vector<llvm::Value*> args{};
-
-                        for (auto i = 1; i < expr.list.size(); i++) {
-                            auto argValue = gen(expr.list[i], env);
-
-                            // Need to cast to parameter type to support sub-classes:
-                            // We should be able to pass Point3D instance for the type of the parent class Point
-                            auto paramTy = fnTy->getParamType(i - 1);
-
-                            if (argValue->getType() != paramTy) {
-                                auto bitCastArgVal = builder->CreateBitCast(argValue, paramTy);
-                                args.push_back(bitCastArgVal);
-                            } else {
-                                args.push_back(argValue);
-                            }
-                        }
+                    auto it = subclasses.find(classInfo->cls);
+
+                    if (it != subclasses.end()) {
+                        classes.insert(classes.end(), it->second.begin(), it->second.end());
+                    }
+                }
+
+                auto call = site.call;
+                auto staticClassInfo = getClassInfo(site.cls);
+
+                // No instances: the call is never executed
+                if (targets.empty()) {
+                    continue;
+                }
+
+                if (targets.size() == 1) {
+                    llvm::IRBuilder<> callBuilder(call);
+                    auto directCall = createDirectCall(callBuilder, call, targets.front());
 
-                        return builder->CreateCall(fnTy, loadedMethod, args);
+                    if (directCall == nullptr) {
+                        continue;
                     }
+
+                    call->replaceAllUsesWith(directCall);
+                    call->eraseFromParent();
+
+                    // vTable and method loads
+                    llvm::RecursivelyDeleteTriviallyDeadInstructions(site.method);
+
+                    devirtualizedCalls_++;
+                    continue;
+                }
+
+                if (!staticClassInfo->instantiated) {
+                    continue;
+                }
+
+                // Speculative: if (method == <static class method>) direct call, else vTable call
+                auto expected = localizeTo(*call->getModule(), *staticClassInfo->methodsMap.find(site.methodName));
+
+                llvm::Instruction* thenTerm;
+                llvm::Instruction* elseTerm;
+
+                llvm::IRBuilder<> guardBuilder(call);
+                auto isExpected = guardBuilder.CreateICmpEQ(site.method, expected, "isexpected");
+
+                llvm::SplitBlockAndInsertIfThenElse(isExpected, call, &thenTerm, &elseTerm);
+
+                thenTerm->getParent()->setName("direct");
+                elseTerm->getParent()->setName("virtual");
+
+                std::vector<llvm::Value*> args(call->arg_begin(), call->arg_end());
+
+                llvm::IRBuilder<> callBuilder(thenTerm);
+                auto directCall = callBuilder.CreateCall(expected, args);
+
+                call->moveBefore(elseTerm);
+
+                if (!call->getType()->isVoidTy()) {
+                    auto merge = thenTerm->getSuccessor(0);
+                    llvm::IRBuilder<> mergeBuilder(merge, merge->begin());
+                    auto result = mergeBuilder.CreatePHI(call->getType(), 2, "result");
+
+                    call->replaceAllUsesWith(result);
+                    result->addIncoming(directCall, directCall->getParent());
+                    result->addIncoming(call, call->getParent());
+                }
+
+                speculativeCalls_++;
+            }
+
+            virtualCalls_.clear();
+        }
+
+        /**
+         * Creates a direct call to the target with the arguments of a
+         * virtual call. An override may take and return subclasses of the
+         * method's types, which are cast. Returns nullptr if the types are
+         * not compatible.
+        */
+        llvm::Value* createDirectCall(llvm::IRBuilder<>& callBuilder, llvm::CallInst* call, llvm::Function* target) {
+            auto targetTy = target->getFunctionType();
+            auto callTy = call->getFunctionType();
+
+            auto castable = [](llvm::Type* from, llvm::Type* to) {
+                return from == to || (from->isPointerTy() && to->isPointerTy());
+            };
+
+            if (targetTy->getNumParams() != callTy->getNumParams() ||
+                !castable(targetTy->getReturnType(), callTy->getReturnType())) {
+                return nullptr;
+            }
+
+            std::vector<llvm::Value*> args;
+
+            for (unsigned i = 0; i < call->arg_size(); i++) {
+                auto arg = call->getArgOperand(i);
+
+                if (!castable(arg->getType(), targetTy->getParamType(i))) {
+                    return nullptr;
                 }
+
+                args.push_back(callBuilder.CreateBitCast(arg, targetTy->getParamType(i)));
+            }
+
+            auto directCall = callBuilder.CreateCall(localizeTo(*call->getModule(), target), args);
+
+            return callBuilder.CreateBitCast(directCall, callTy->getReturnType());
+        }
+
+        /**
+         * Module import: (import "path")
+         *
+         * The path is relative to the importing file. Each file is compiled
+         * once into its own module, and its top-level functions are defined
+         * in the importing scope (classes are global). The top-level code of
+         * the file runs on the first import executed.
+        */
+        llvm::Value* genImport(const Exp& expr) {
+            if (expr.list.size() != 2 || expr.list[1].type != ExpType::STRING) {
+                DIE << "[EvaLLVM]: Expected (import \"<path>\")";
+            }
+
+            if (fn != fileInit_ || cls != nullptr) {
+                DIE << "[EvaLLVM]: Imports are only allowed at the top level";
+            }
+
+            auto path = resolveImport(expr.list[1].string);
+            auto it = imports_.find(path);
+            auto& file = it == imports_.end() ? compileImport(path) : it->second;
+
+            if (!file.compiled) {
+                DIE << "[EvaLLVM]: Import cycle through " << path;
+            }
+
+            for (auto& exported : file.exports) {
+                env.define(exported.first, exported.second);
             }
 
+            builder->CreateCall(localize(file.init));
+
             return builder->getInt32(0);
         }
 
+        /**
+         * Real path of an imported file.
+        */
+        std::string resolveImport(std::string_view importPath) {
+            llvm::SmallString<256> path;
+            llvm::StringRef relativePath(importPath.data(), importPath.size());
+
+            if (!llvm::sys::path::is_absolute(relativePath)) {
+                path = llvm::sys::path::parent_path(currentFile_);
+            }
+
+            llvm::sys::path::append(path, relativePath);
+
+            llvm::SmallString<256> realPath;
+
+            if (auto errorCode = llvm::sys::fs::real_path(path, realPath)) {
+                DIE << "[EvaLLVM]: Cannot import " << path.str().str() << ": " << errorCode.message();
+            }
+
+            return realPath.str().str();
+        }
+
+        /**
+         * Compiles an imported file into its own module. Its top-level code
+         * goes to an init function, which runs once.
+        */
+        ImportedFile& compileImport(const std::string& path) {
+            auto& file = imports_[path];
+            file.compiled = false;
+
+            auto source = llvm::MemoryBuffer::getFile(path, /* IsText */ false, /* RequiresNullTerminator */ false);
+
+            if (!source) {
+                DIE << "[EvaLLVM]: Cannot import " << path << ": " << source.getError().message();
+            }
+
+            // Own parser: the AST of the importing file is still in use.
+            // The source and the AST are only needed until the file is compiled.
+            auto fileParser = std::make_unique<EvaParser>();
+            Exp ast{ExpList{}};
+
+            {
+                TimeReport::Phase phase(timeReport_.get(), "parsing");
+                auto program = (*source)->getBuffer();
+                ast = ParallelParser(*fileParser).parseProgram(std::string_view(program.data(), program.size()));
+            }
+
+            // Save the state of the importing file
+            auto importerModule = std::move(module);
+            auto importerFile = currentFile_;
+            auto importerFn = fn;
+            auto importerInit = fileInit_;
+            auto importerExports = fileExports_;
+            auto importerBlock = builder->GetInsertBlock();
+            auto importerPrintfFn = printfFn;
+            auto importerGcMallocFn = gcMallocFn;
+            auto importerGcMallocAtomicFn = gcMallocAtomicFn;
+            auto importerGcWriteBarrierFn = gcWriteBarrierFn;
+
+            module = std::make_unique<llvm::Module>(path, *ctx);
+            module->setTargetTriple(importerModule->getTargetTriple());
+            module->setDataLayout(importerModule->getDataLayout());
+
+            setupExternalFunctions();
+
+            currentFile_ = path;
+            fileExports_ = &file.exports;
+
+            // Init function: entry (locals) -> body, or done if it already ran
+            auto initName = ("eva.init." + llvm::sys::path::stem(path) + "." + llvm::Twine(imports_.size())).str();
+
+            fn = fileInit_ = file.init = llvm::Function::Create(
+                llvm::FunctionType::get(builder->getVoidTy(), /* vararg */ false),
+                llvm::Function::InternalLinkage, initName, *module);
+
+            addTargetAttributes(fn);
+            addGCAttributes(fn);
+
+            auto initialized = new llvm::GlobalVariable(
+                *module, builder->getInt1Ty(), /* isConstant */ false, llvm::GlobalValue::InternalLinkage,
+                builder->getFalse(), initName + ".done");
+
+            auto entryBlock = createBasicBlock("entry", fn);
+            auto bodyBlock = createBasicBlock("body", fn);
+            auto doneBlock = createBasicBlock("done", fn);
+
+            builder->SetInsertPoint(bodyBlock);
+            builder->CreateStore(builder->getTrue(), initialized);
+
+            gen(ast);
+
+            builder->CreateRetVoid();
+
+            builder->SetInsertPoint(doneBlock);
+            builder->CreateRetVoid();
+
+            builder->SetInsertPoint(entryBlock);
+            builder->CreateCondBr(builder->CreateLoad(builder->getInt1Ty(), initialized, "initialized"), doneBlock, bodyBlock);
+
+            file.compiled = true;
+            importedModules_.push_back(std::move(module));
+
+            // Restore the importing file
+            module = std::move(importerModule);
+            currentFile_ = importerFile;
+            fn = importerFn;
+            fileInit_ = importerInit;
+            fileExports_ = importerExports;
+            builder->SetInsertPoint(importerBlock);
+            printfFn = importerPrintfFn;
+            gcMallocFn = importerGcMallocFn;
+            gcMallocAtomicFn = importerGcMallocAtomicFn;
+            gcWriteBarrierFn = importerGcWriteBarrierFn;
+
+            return file;
+        }
+
+        /**
+         * Unescapes special characters of a string literal. TODO: support all chars or handle in parser
+        */
+        std::string unescape(std::string_view str) {
+            std::string result;
+            result.reserve(str.size());
+
+            for (size_t i = 0; i < str.size(); i++) {
+                if (str[i] == '\\' && i + 1 < str.size() && str[i + 1] == 'n') {
+                    result.push_back('\n');
+                    i++;
+                } else {
+                    result.push_back(str[i]);
+                }
+            }
+
+            return result;
+        }
+
         /**
          * Returns field index
         */
-        size_t getFieldIndex(llvm::StructType* cls, const std::string& fieldName) {
-            auto fields = &classMap_[cls->getName().data()].fieldsMap;
-            auto it = fields->find(fieldName);
+        size_t getFieldIndex(llvm::StructType* cls, Symbol fieldName) {
+            auto idx = getClassInfo(cls)->fieldsMap.indexOf(fieldName);
+
+            if (idx == SymbolMap<llvm::Type*>::npos) {
+                DIE << "[EvaLLVM]: Unknown field " << symbols().name(fieldName) << " in class " << cls->getName().str();
+            }
 
-            return std::distance(fields->begin(), it) + RESERVED_FIELDS_COUNT;
+            return idx + RESERVED_FIELDS_COUNT;
         }
 
         /**
          * Returns method index
         */
-        size_t getMethodIndex(llvm::StructType* cls, const std::string& methodName) {
-            auto methods = &classMap_[cls->getName().data()].methodsMap;
-            auto it = methods->find(methodName);
+        size_t getMethodIndex(llvm::StructType* cls, Symbol methodName) {
+            auto idx = getClassInfo(cls)->methodsMap.indexOf(methodName);
+
+            if (idx == SymbolMap<llvm::Function*>::npos) {
+                DIE << "[EvaLLVM]: Unknown method " << symbols().name(methodName) << " in class " << cls->getName().str();
+            }
+
+            return idx;
+        }
+
+        /**
+         * Returns method function
+        */
+        llvm::Function* getMethod(llvm::StructType* cls, Symbol methodName) {
+            auto method = getClassInfo(cls)->methodsMap.find(methodName);
+
+            if (method == nullptr) {
+                DIE << "[EvaLLVM]: Unknown method " << symbols().name(methodName) << " in class " << cls->getName().str();
+            }
 
-            return std::distance(methods->begin(), it);
+            return *method;
         }
 
         /**
          * Creates an instane of a class
         */
-        llvm::Value* createInstance(const Exp& exp, Env env, const std::string& name) {
-            auto className = exp.list[1].string;
+        llvm::Value* createInstance(const Exp& exp, llvm::StringRef name) {
+            auto className = exp.list[1].symbol;
             auto cls = getClassByName(className);
 
             if (cls == nullptr) {
-                DIE << "[EvaLLVM]: Unknown class " << cls;
+                DIE << "[EvaLLVM]: Unknown class " << exp.list[1].string;
             }
 
-            // NOTE: Stack allocation (TODO: Heap allocation)
-            // auto instance = name.empty() ? builder->CreateAlloca(cls) : builder->CreateAlloca(cls, 0, name);
-
-            // We do not use stack allocation for objects, since we need to support constructor (factory) pattern
-            // i.e. return a object from a callee to the caller, outside
-            
-            // Heap Allocation:
+            // Heap Allocation: objects can be returned from a callee to the caller (constructor/factory pattern).
+            // Objects which do not outlive the frame are moved to the stack by the optimizer (HeapToStackPass)
             auto instance = mallocInstance(cls, name);
+            getClassInfo(cls)->instantiated = true;
 
             // Call constructor
-            auto ctor = module->getFunction(className + "_constructor");
+            auto ctor = localize(getMethod(cls, KW_CONSTRUCTOR));
 
-            std::vector<llvm::Value*> args{instance};
+            // Subclasses without an own constructor use the inherited one
+            std::vector<llvm::Value*> args{builder->CreateBitCast(instance, ctor->getArg(0)->getType())};
 
-            for (auto i = 2; i < exp.list.size(); i++) {
-                args.push_back(gen(exp.list[i], env));
+            for (size_t i = 2; i < exp.list.size(); i++) {
+                args.push_back(gen(exp.list[i]));
             }
 
             builder->CreateCall(ctor, args);
@@ -595,25 +1606,46 @@ class EvaLLVM {
         /**
          * Allocates an object of a given class on the heap
         */
-        llvm::Value* mallocInstance(llvm::StructType* cls, const std::string& name) {
-            auto typeSize = builder->getInt64(getTypeSize(cls));
-
-            // void*
-            auto mallocPtr = builder->CreateCall(module->getFunction("GC_malloc"), typeSize, name);
+        llvm::Value* mallocInstance(llvm::StructType* cls, llvm::StringRef name) {
+            llvm::Value* mallocPtr;
+
+            if (options_.gc == GCKind::PRECISE) {
+                // eva_gc_alloc(typeMap): the fast path is inlined when the GC is lowered (InlineAllocationPass),
+                // and the type map tells the collector whether to scan the object
+                mallocPtr = builder->CreateCall(gcMallocFn, builder->CreateBitCast(localize(getClassInfo(cls)->typeMap), builder->getInt8PtrTy()), name);
+            } else if (isPointerFree(cls)) {
+                // GC_malloc_atomic(size): not scanned, and not zeroed
+                mallocPtr = builder->CreateCall(gcMallocAtomicFn, builder->getInt64(getTypeSize(cls)), name);
+                builder->CreateMemSet(mallocPtr, builder->getInt8(0), getTypeSize(cls), llvm::MaybeAlign(16));
+            } else {
+                // GC_malloc(size)
+                mallocPtr = builder->CreateCall(gcMallocFn, builder->getInt64(getTypeSize(cls)), name);
+            }
 
             // void* -> Class*
-            auto instance = builder->CreatePointerCast(mallocPtr, cls->getPointerTo());
+            auto instance = builder->CreatePointerCast(mallocPtr, getObjectPointerTy(cls));
 
             // Install the vTable to lookup methods:
-            std::string className{cls->getName().data()};
-            auto vTableName = className + "_vTable";
             auto vTableAddr = builder->CreateStructGEP(cls, instance, VTABLE_INDEX);
-            auto vTable = module->getNamedGlobal(vTableName);
-            builder->CreateStore(vTable, vTableAddr);
+            builder->CreateStore(localize(getClassInfo(cls)->vTable), vTableAddr);
 
             return instance;
         }
 
+        /**
+         * Whether the fields of a class hold no pointers (the vTable is
+         * not allocated by the GC)
+        */
+        bool isPointerFree(llvm::StructType* cls) {
+            for (unsigned i = RESERVED_FIELDS_COUNT; i < cls->getNumElements(); i++) {
+                if (cls->getElementType(i)->isPointerTy()) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
         /**
          * Returns the size of a type in bytes
         */
@@ -624,34 +1656,41 @@ class EvaLLVM {
         /**
          * Inherits parent class fields
         */
-        void inheritClass(llvm::StructType* cls, llvm::StructType* parent) {
-            auto parentClassInfo = &classMap_[parent->getName().data()];
+        void inheritClass(Symbol name, llvm::StructType* cls, llvm::StructType* parent) {
+            auto parentClassInfo = getClassInfo(parent);
 
             // Inherit the field and method names
-            classMap_[cls->getName().data()] = {
+            classMap_[name] = {
                 /* class */ cls,
                 /* parent */ parent,
                 /* fields */ parentClassInfo->fieldsMap,
-                /* methods */ parentClassInfo->methodsMap
+                /* methods */ parentClassInfo->methodsMap,
+                /* vTable type */ nullptr,
+                /* vTable */ nullptr,
+                /* final */ false,
+                /* final methods */ parentClassInfo->finalMethods,
+                /* instantiated */ false,
+                /* type map */ nullptr
             };
         }
 
         /**
          * Extracts fields and methods from a class expression
         */
-        void buildClassInfo(llvm::StructType* cls, const Exp& clsExp, Env env) {
-            auto className = clsExp.list[1].string;
-            auto classInfo = &classMap_[className];
+        void buildClassInfo(llvm::StructType* cls, const Exp& clsExp) {
+            auto classInfo = getClassInfo(cls);
 
             // Body block: (begin ...)
-            auto body = clsExp.list[3];
+            const auto& body = clsExp.list[3];
 
-            for (auto i = 1; i < body.list.size(); i++) {
-                auto exp = body.list[i];
+            for (size_t i = 1; i < body.list.size(); i++) {
+                // (final (def ...))
+                auto isFinalMethod = isTaggedList(body.list[i], KW_FINAL);
+                const auto& exp = isFinalMethod ? body.list[i].list[1] : body.list[i];
 
                 // If is variable
                 if (isVar(exp)) {
-                    auto varNameDecl = exp.list[1];
+                    const auto& varNameDecl = exp.list[1];
 
                     auto fieldName = extractVarName(varNameDecl);
                     auto fieldTy = extractVarType(varNameDecl);
@@ -661,10 +1700,18 @@ class EvaLLVM {
 
                 // If is function
                 else if (isDef(exp)) {
-                    auto methodName = exp.list[1].string;
-                    auto fnName = className + "_" + methodName;
+                    auto methodName = exp.list[1].symbol;
+                    auto fnName = cls->getName() + "_" + exp.list[1].string;
 
-                    classInfo->methodsMap[methodName] = createFunctionProto(fnName, extractFunctionType(exp), env);
+                    if (classInfo->finalMethods.count(methodName) != 0) {
+                        DIE << "[EvaLLVM]: Class " << cls->getName().str() << " overrides final method " << exp.list[1].string;
+                    }
+
+                    if (isFinalMethod) {
+                        classInfo->finalMethods.insert(methodName);
+                    }
+
+                    classInfo->methodsMap[methodName] = createFunctionProto(fnName.str(), extractFunctionType(exp));
                 }
             }
 
@@ -676,18 +1723,15 @@ class EvaLLVM {
          * Builds the class body from class info
         */
         void buildClassBody(llvm::StructType* cls) {
-            std::string className{cls->getName().data()};
-
-            auto classInfo = &classMap_[className];
+            auto classInfo = getClassInfo(cls);
 
             // Allocate vTable to set its type in the body
             // The table itself is populated later in buildVTable
-            auto vTableName = className + "_vTable";
-            auto vTableType = llvm::StructType::create(*ctx, vTableName);
+            classInfo->vTableTy = llvm::StructType::create(*ctx, (cls->getName() + "_vTable").str());
 
             auto clsFields = std::vector<llvm::Type*>{
                 // First element is always the vTable:
-                vTableType->getPointerTo()
+                classInfo->vTableTy->getPointerTo()
             };
 
             // Field types:
@@ -699,6 +1743,10 @@ class EvaLLVM {
 
             // Methods:
             buildVTable(cls);
+
+            if (options_.gc == GCKind::PRECISE) {
+                buildTypeMap(cls);
+            }
         }
 
         /**
@@ -707,18 +1755,18 @@ class EvaLLVM {
          * vTables store method references to support inheritance and methods overloading
         */
         void buildVTable(llvm::StructType* cls) {
-            std::string className{cls->getName().data()};
-            auto vTableName = className + "_vTable";
+            auto classInfo = getClassInfo(cls);
 
-            // The vTable should already exist:
-            auto vTableTy = llvm::StructType::getTypeByName(*ctx, vTableName);
+            // The vTable type should already exist:
+            auto vTableTy = classInfo->vTableTy;
 
             std::vector<llvm::Constant*> vTableMethods;
             std::vector<llvm::Type*> vTableMethodTys;
 
-            for (auto& methodInfo : classMap_[className].methodsMap) {
-                auto method = methodInfo.second;
-                
+            for (auto& methodInfo : classInfo->methodsMap) {
+                // Inherited methods may be defined in another file
+                auto method = localize(methodInfo.second);
+
                 vTableMethods.push_back(method);
                 vTableMethodTys.push_back(method->getType());
             }
@@ -726,46 +1774,91 @@ class EvaLLVM {
             vTableTy->setBody(vTableMethodTys);
 
             auto vTableValue = llvm::ConstantStruct::get(vTableTy, vTableMethods);
-            createGlobalVar(vTableName, vTableValue);
+            classInfo->vTable = createGlobalVar(vTableTy->getName().str(), vTableValue, /* isConstant */ true);
+        }
+
+        /**
+         * Creates the type map of a class for the precise GC (EvaTypeMap):
+         * { i64 size, i64 pointerCount, [pointerCount x i64] pointerOffsets }
+        */
+        void buildTypeMap(llvm::StructType* cls) {
+            auto classInfo = getClassInfo(cls);
+            auto layout = module->getDataLayout().getStructLayout(cls);
+
+            std::vector<llvm::Constant*> pointerOffsets;
+
+            for (unsigned i = RESERVED_FIELDS_COUNT; i < cls->getNumElements(); i++) {
+                auto fieldTy = cls->getElementType(i);
+
+                if (fieldTy->isPointerTy() && fieldTy->getPointerAddressSpace() == GC_ADDRESS_SPACE) {
+                    pointerOffsets.push_back(builder->getInt64(layout->getElementOffset(i)));
+                }
+            }
+
+            auto offsetsTy = llvm::ArrayType::get(builder->getInt64Ty(), pointerOffsets.size());
+
+            auto typeMapValue = llvm::ConstantStruct::getAnon({
+                builder->getInt64(getTypeSize(cls)),
+                builder->getInt64(pointerOffsets.size()),
+                llvm::ConstantArray::get(offsetsTy, pointerOffsets),
+            });
+
+            classInfo->typeMap = createGlobalVar((cls->getName() + "_typeMap").str(), typeMapValue, /* isConstant */ true);
         }
 
         /**
          * Tagged Lists
         */
-        bool isTaggedList(const Exp& exp, const std::string& tag) {
-            return exp.type == ExpType::LIST && exp.list[0].type == ExpType::SYMBOL && exp.list[0].string == tag;
+        bool isTaggedList(const Exp& exp, Symbol tag) {
+            return exp.type == ExpType::LIST && !exp.list.empty() && exp.list[0].type == ExpType::SYMBOL && exp.list[0].symbol == tag;
         }
 
         /**
          * Is: (var ...)
         */
-        bool isVar(const Exp& exp) { return isTaggedList(exp, "var"); }
+        bool isVar(const Exp& exp) { return isTaggedList(exp, KW_VAR); }
 
         /**
          * Is: (def ...)
         */
-        bool isDef(const Exp& exp) { return isTaggedList(exp, "def"); }
+        bool isDef(const Exp& exp) { return isTaggedList(exp, KW_DEF); }
 
         /**
          * Is: (new ...)
         */
-        bool isNew(const Exp& exp) { return isTaggedList(exp, "new"); }
+        bool isNew(const Exp& exp) { return isTaggedList(exp, KW_NEW); }
 
         /**
          * Is: (prop ...)
         */
-        bool isProp(const Exp& exp) { return isTaggedList(exp, "prop"); }
+        bool isProp(const Exp& exp) { return isTaggedList(exp, KW_PROP); }
 
         /**
          * Is: (super ...)
         */
-        bool isSuper(const Exp& exp) { return isTaggedList(exp, "super"); }
+        bool isSuper(const Exp& exp) { return isTaggedList(exp, KW_SUPER); }
 
         /**
          * Returns a class type by name
         */
-        llvm::StructType* getClassByName(const std::string& name) {
-            return llvm::StructType::getTypeByName(*ctx, name);
+        llvm::StructType* getClassByName(Symbol name) {
+            auto classInfo = getClassInfoByName(name);
+            return classInfo == nullptr ? nullptr : classInfo->cls;
+        }
+
+        /**
+         * Returns class info by name, or nullptr if the class is not defined
+        */
+        ClassInfo* getClassInfoByName(Symbol name) {
+            auto it = classMap_.find(name);
+            return it == classMap_.end() ? nullptr : &it->second;
+        }
+
+        /**
+         * Returns class info of a class type
+        */
+        ClassInfo* getClassInfo(llvm::StructType* cls) {
+            return classByType_.at(cls);
         }
 
         /**
@@ -774,8 +1867,8 @@ class EvaLLVM {
          * x -> x
          * (x number) -> x
         */
-        std::string extractVarName(const Exp& expr) {
-            return expr.type == ExpType::LIST ? expr.list[0].string : expr.string;
+        Symbol extractVarName(const Exp& expr) {
+            return expr.type == ExpType::LIST ? expr.list[0].symbol : expr.symbol;
         }
 
         /**
@@ -785,32 +1878,45 @@ class EvaLLVM {
          * (x number) -> number
         */
         llvm::Type* extractVarType(const Exp& expr) {
-            return expr.type == ExpType::LIST ? getTypeFromString(expr.list[1].string) : builder->getInt32Ty();
+            return expr.type == ExpType::LIST ? getTypeFromName(expr.list[1].symbol) : builder->getInt32Ty();
         }
 
         /**
-         * Returns LLVM type from string representation
+         * Returns LLVM type from type name
         */
-        llvm::Type* getTypeFromString(const std::string& type_) {
+        llvm::Type* getTypeFromName(Symbol type_) {
             // number -> i32
-            if (type_ == "number") {
+            if (type_ == KW_NUMBER) {
                 return builder->getInt32Ty();
             }
 
             // string -> i8* (aka char*)
-            if (type_ == "string") {
+            if (type_ == KW_STRING) {
                 return builder->getInt8Ty()->getPointerTo();
             }
 
             // Classes:
-            return classMap_[type_].cls->getPointerTo();
+            auto cls = getClassByName(type_);
+
+            if (cls == nullptr) {
+                DIE << "[EvaLLVM]: Unknown type " << symbols().name(type_);
+            }
+
+            return getObjectPointerTy(cls);
+        }
+
+        /**
+         * Pointer to an object of the class (a GC pointer for the precise GC)
+        */
+        llvm::PointerType* getObjectPointerTy(llvm::StructType* cls) {
+            return cls->getPointerTo(options_.gc == GCKind::PRECISE ? GC_ADDRESS_SPACE : 0);
         }
 
         /**
          * Whether the function has a return type defined
         */
         bool hasReturnType(const Exp& fnExp) {
-            return fnExp.list[3].type == ExpType::SYMBOL && fnExp.list[3].string == "->";
+            return fnExp.list[3].type == ExpType::SYMBOL && fnExp.list[3].symbol == KW_ARROW;
         }
 
         /**
@@ -821,10 +1927,10 @@ class EvaLLVM {
          * llvm::FunctionType::get(returnType, paramTypes, false);
         */
         llvm::FunctionType* extractFunctionType(const Exp& fnExp) {
-            auto params = fnExp.list[2];
+            const auto& params = fnExp.list[2];
 
             // Return type:
-            auto returnType = hasReturnType(fnExp) ? getTypeFromString(fnExp.list[4].string) : builder->getInt32Ty();
+            auto returnType = hasReturnType(fnExp) ? getTypeFromName(fnExp.list[4].symbol) : builder->getInt32Ty();
 
             // Parameter Types:
             std::vector<llvm::Type*> paramTypes{};
@@ -834,7 +1940,7 @@ class EvaLLVM {
                 auto paramTy = extractVarType(param);
 
                 // The `self` name is special, meaning instance of a class
-                paramTypes.push_back(paramName == "self" ? (llvm::Type*)cls->getPointerTo() : paramTy);
+                paramTypes.push_back(paramName == KW_SELF ? (llvm::Type*)getObjectPointerTy(cls) : paramTy);
             }
 
             return llvm::FunctionType::get(returnType, paramTypes, /* varargs */ false);
@@ -847,44 +1953,45 @@ class EvaLLVM {
          * 
          * Typed: (def square ((x number)) -> number (* x x))
         */
-        llvm::Value* compileFunction(const Exp& fnExp, std::string fnName, Env env) {
-            auto params = fnExp.list[2];
-            auto body = hasReturnType(fnExp) ? fnExp.list[5] : fnExp.list[3];
+        llvm::Value* compileFunction(const Exp& fnExp, Symbol fnName) {
+            const auto& params = fnExp.list[2];
+            const auto& body = hasReturnType(fnExp) ? fnExp.list[5] : fnExp.list[3];
 
             // Save current fn:
             auto prevFn = fn;
             auto prevBlock = builder->GetInsertBlock();
 
-            // TODO: DELETE VAR IF NOT USED
-            auto origFnName = fnName;
+            llvm::Function* newFn;
 
-            // Class method names:
+            // Class methods are already declared in the class info:
             if (cls != nullptr) {
-                fnName = std::string(cls->getName().data()) + "_" + fnName;
+                newFn = getMethod(cls, fnName);
+                createFunctionBlock(newFn);
+            } else {
+                newFn = createFunction(std::string(symbols().name(fnName)), extractFunctionType(fnExp));
             }
 
             // Override fn to compile body:
-            auto newFn = createFunction(fnName, extractFunctionType(fnExp), env);
             fn = newFn;
 
             // Set parameter names:
             auto idx = 0;
 
-            // Function environment for params:
-            auto fnEnv = std::make_shared<Environment>(std::map<std::string, llvm::Value*>{}, env);
+            // Function scope for params:
+            Environment::Scope fnScope(env);
 
             for (auto& arg : fn->args()) {
-                auto param = params.list[idx++];
+                const auto& param = params.list[idx++];
                 auto argName = extractVarName(param);
 
-                arg.setName(argName);
+                arg.setName(symbols().name(argName));
 
                 // Allocate a local variable per argument to make arguments mutable
-                auto argBinding = allocVar(argName, arg.getType(), fnEnv);
+                auto argBinding = allocVar(argName, arg.getType());
                 builder->CreateStore(&arg, argBinding);
             }
 
-            builder->CreateRet(gen(body, fnEnv));
+            builder->CreateRet(gen(body));
 
             // Restore the previous fn after compiling
             builder->SetInsertPoint(prevBlock);
@@ -896,60 +2003,139 @@ class EvaLLVM {
         /**
          * Allocates a local variable on the stack. Result is the alloca instruction
         */
-        llvm::Value* allocVar(const std::string& name, llvm::Type* type_, Env env) {
+        llvm::Value* allocVar(Symbol name, llvm::Type* type_) {
             varsBuilder->SetInsertPoint(&fn->getEntryBlock());
 
-            auto varAlloc = varsBuilder->CreateAlloca(type_, 0, name.c_str());
+            auto varAlloc = varsBuilder->CreateAlloca(type_, 0, symbols().name(name));
 
             // Add to the environment:
-            env->define(name, varAlloc);
+            env.define(name, varAlloc);
 
             return varAlloc;
         }
 
         /**
-         * Creates a global variable
+         * Creates a global variable, internal to the program. Constants
+         * have no significant address, so identical ones can be merged.
+         * The alignment is the data layout's one for the type.
         */
-        llvm::GlobalVariable* createGlobalVar(const std::string& name, llvm::Constant* init) {
+        llvm::GlobalVariable* createGlobalVar(const std::string& name, llvm::Constant* init, bool isConstant = false) {
             module->getOrInsertGlobal(name, init->getType());
 
             auto variable = module->getNamedGlobal(name);
-            variable->setAlignment(llvm::MaybeAlign(4));
-            variable->setConstant(false);
+            variable->setLinkage(llvm::GlobalValue::InternalLinkage);
+            variable->setConstant(isConstant);
             variable->setInitializer(init);
 
+            if (isConstant) {
+                variable->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+            }
+
             return variable;
         }
 
         /**
-         * Define external functions (from libc++)
+         * Returns a global value as seen from the current module: globals
+         * of other files' modules are declared in it. Other values as is.
         */
-        void setupExternalFunctions() {
-            // i8* to substitute for char*, void*, etc
-            auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        template <typename T>
+        T* localize(T* value) {
+            return localizeTo(*module, value);
+        }
 
-            // int printf (const char* format, ...);
-            module->getOrInsertFunction("printf", llvm::FunctionType::get(
-                /* return type */ builder->getInt32Ty(),
-                /* format arg */ bytePtrTy,
-                /* vararg */ true
-            ));
+        /**
+         * Returns a global value as seen from a module. Globals used by
+         * other modules are exported: external, but hidden in the executable.
+        */
+        template <typename T>
+        static T* localizeTo(llvm::Module& module, T* value) {
+            auto global = llvm::dyn_cast<llvm::GlobalValue>(value);
+
+            if (global == nullptr || global->getParent() == &module) {
+                return value;
+            }
+
+            if (global->hasLocalLinkage()) {
+                global->setLinkage(llvm::GlobalValue::ExternalLinkage);
+                global->setVisibility(llvm::GlobalValue::HiddenVisibility);
+            }
+
+            if (auto function = llvm::dyn_cast<llvm::Function>(global)) {
+                auto declaration = module.getFunction(function->getName());
+
+                if (declaration == nullptr) {
+                    declaration = llvm::Function::Create(
+                        function->getFunctionType(), llvm::GlobalValue::ExternalLinkage, function->getName(), module);
+                    declaration->copyAttributesFrom(function);
+                }
+
+                return llvm::cast<T>(declaration);
+            }
+
+            auto variable = llvm::cast<llvm::GlobalVariable>(global);
+            auto declaration = module.getNamedGlobal(variable->getName());
+
+            if (declaration == nullptr) {
+                declaration = new llvm::GlobalVariable(
+                    module, variable->getValueType(), variable->isConstant(), llvm::GlobalValue::ExternalLinkage,
+                    /* Initializer */ nullptr, variable->getName());
+                declaration->copyAttributesFrom(variable);
+            }
+
+            return llvm::cast<T>(declaration);
+        }
+
+        /**
+         * Define external functions (from libc++)
+        */
+        void setupExternalFunctions() {
+            // i8* to substitute for char*, void*, etc
+            auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+
+            // int printf (const char* format, ...);
+            printfFn = (llvm::Function*)module->getOrInsertFunction("printf", llvm::FunctionType::get(
+                /* return type */ builder->getInt32Ty(),
+                /* format arg */ bytePtrTy,
+                /* vararg */ true
+            )).getCallee();
+
+            if (options_.gc == GCKind::PRECISE) {
+                auto gcPtrTy = builder->getInt8Ty()->getPointerTo(GC_ADDRESS_SPACE);
+
+                // void* eva_gc_alloc(const EvaTypeMap* typeMap)
+                gcMallocFn = (llvm::Function*)module->getOrInsertFunction("eva_gc_alloc", llvm::FunctionType::get(gcPtrTy, bytePtrTy, /* vararg */ false)).getCallee();
+
+                // void eva_gc_write_barrier(void* object)
+                gcWriteBarrierFn = (llvm::Function*)module->getOrInsertFunction("eva_gc_write_barrier", llvm::FunctionType::get(builder->getVoidTy(), gcPtrTy, /* vararg */ false)).getCallee();
+                gcWriteBarrierFn->addParamAttr(0, llvm::Attribute::NoCapture);
+
+                // Calls which never collect are not safepoints
+                printfFn->addFnAttr("gc-leaf-function");
+                gcWriteBarrierFn->addFnAttr("gc-leaf-function");
+            } else {
+                // void* malloc(size_t size), void* GC_malloc(size_t size)
+                // size_t is i64
+                gcMallocFn = (llvm::Function*)module->getOrInsertFunction("GC_malloc", llvm::FunctionType::get(bytePtrTy, builder->getInt64Ty(), /* vararg */ false)).getCallee();
+
+                // void* GC_malloc_atomic(size_t size): objects without pointers, not scanned
+                gcMallocAtomicFn = (llvm::Function*)module->getOrInsertFunction("GC_malloc_atomic", llvm::FunctionType::get(bytePtrTy, builder->getInt64Ty(), /* vararg */ false)).getCallee();
+                gcMallocAtomicFn->addRetAttr(llvm::Attribute::NoAlias);
+            }
 
-            // void* malloc(size_t size), void* GC_malloc(size_t size)
-            // size_t is i64
-            module->getOrInsertFunction("GC_malloc", llvm::FunctionType::get(bytePtrTy, builder->getInt64Ty(), /* vararg */ false));
+            // Fresh memory, not aliased by anything else (stores to objects are forwarded)
+            gcMallocFn->addRetAttr(llvm::Attribute::NoAlias);
         }
 
         /**
          * Creates a function
         */
-        llvm::Function* createFunction(const std::string& fnName, llvm::FunctionType* fnType, Env env) {
+        llvm::Function* createFunction(const std::string& fnName, llvm::FunctionType* fnType) {
             // Function prototype might already be defined
             auto fn = module->getFunction(fnName);
 
             // If not, allocate the function:
             if (fn == nullptr) {
-                fn = createFunctionProto(fnName, fnType, env);
+                fn = createFunctionProto(fnName, fnType);
             }
 
             createFunctionBlock(fn);
@@ -958,19 +2144,45 @@ class EvaLLVM {
         }
 
         /**
-         * Creates a function prototype (defines the function, not the body)
+         * Creates a function prototype (defines the function, not the body).
+         * Functions are internal to the program, except main.
         */
-        llvm::Function* createFunctionProto(const std::string& fnName, llvm::FunctionType* fnType, Env env) {
-            auto fn = llvm::Function::Create(fnType, llvm::Function::ExternalLinkage, fnName, *module);
+        llvm::Function* createFunctionProto(const std::string& fnName, llvm::FunctionType* fnType) {
+            auto linkage = fnName == "main" ? llvm::Function::ExternalLinkage : llvm::Function::InternalLinkage;
+            auto fn = llvm::Function::Create(fnType, linkage, fnName, *module);
+
+            addTargetAttributes(fn);
+            addGCAttributes(fn);
 
             verifyFunction(*fn);
 
             // Install in the environment
-            env->define(fnName, fn);
+            env.define(symbols().intern(fnName), fn);
 
             return fn;
         }
 
+        /**
+         * Per-function target, as the IR may be compiled separately
+        */
+        void addTargetAttributes(llvm::Function* fn) {
+            fn->addFnAttr("target-cpu", targetMachine_->getTargetCPU());
+
+            if (!targetMachine_->getTargetFeatureString().empty()) {
+                fn->addFnAttr("target-features", targetMachine_->getTargetFeatureString());
+            }
+        }
+
+        /**
+         * Precise GC: calls are statepoints, whose frames are walked with frame pointers
+        */
+        void addGCAttributes(llvm::Function* fn) {
+            if (options_.gc == GCKind::PRECISE) {
+                fn->setGC(GC_STRATEGY);
+                fn->addFnAttr("frame-pointer", "all");
+            }
+        }
+
         /**
          * Creates a function block
         */
@@ -985,19 +2197,717 @@ class EvaLLVM {
          * If the `fn` is passed in, the block is automatically appended to the parent function.
          * Otherwise, the block should later be appeneded manually via fn->getBasicBlockList().push_back(block)
         */
-        llvm::BasicBlock* createBasicBlock(std::string name, llvm::Function* fn = nullptr) {
+        llvm::BasicBlock* createBasicBlock(const llvm::Twine& name, llvm::Function* fn = nullptr) {
             return llvm::BasicBlock::Create(*ctx, name, fn)
 ;        }
 
+        /**
+         * Writes the module in the requested output format.
+        */
+        void emitOutput() {
+            switch (options_.emit) {
+                case EmitKind::LL: {
+                    TimeReport::Phase phase(timeReport_.get(), "output");
+                    saveModuleToFile(outputFile("./dist/out.ll"));
+                    break;
+                }
+
+                case EmitKind::BC: {
+                    TimeReport::Phase phase(timeReport_.get(), "output");
+                    saveBitcodeToFile(outputFile("./dist/out.bc"));
+                    break;
+                }
+
+                case EmitKind::OBJ: {
+                    TimeReport::Phase phase(timeReport_.get(), "native codegen");
+                    emitObjectFile(*module, *targetMachine_, outputFile("./dist/out.o"));
+                    break;
+                }
+
+                case EmitKind::EXE: {
+                    if (!options_.incrementalCacheDir.empty()) {
+                        emitIncremental();
+                        break;
+                    }
+
+                    if (options_.codegenPartitions > 1) {
+                        emitPartitioned();
+                        break;
+                    }
+
+                    if (!importedModules_.empty()) {
+                        emitThinLTO();
+                        break;
+                    }
+
+                    llvm::SmallString<128> objectFile;
+
+                    if (auto errorCode = llvm::sys::fs::createTemporaryFile("eva", "o", objectFile)) {
+                        DIE << "Cannot create a temporary object file: " << errorCode.message();
+                    }
+
+                    {
+                        TimeReport::Phase phase(timeReport_.get(), "native codegen");
+                        emitObjectFile(*module, *targetMachine_, std::string(objectFile));
+                    }
+
+                    {
+                        TimeReport::Phase phase(timeReport_.get(), "linking");
+                        linkExecutable({std::string(objectFile)}, outputFile("./dist/out"));
+                    }
+
+                    llvm::sys::fs::remove(objectFile);
+                    break;
+                }
+
+                case EmitKind::NONE:
+                    break;
+            }
+        }
+
+        /**
+         * Runs main of the module with ORC LLJIT, returns its exit code.
+         *
+         * In lazy mode each function is compiled on its first call through
+         * a lazy reexport stub, so large programs whose code is mostly cold
+         * start quickly. External functions (printf, GC_malloc) are resolved
+         * against the host process.
+        */
+        int runJIT() {
+            std::unique_ptr<llvm::orc::LLJIT> jit;
+            std::unique_ptr<TieredJIT> tieredJit;
+
+            {
+                TimeReport::Phase phase(timeReport_.get(), "JIT setup");
+
+                llvm::InitializeNativeTarget();
+                llvm::InitializeNativeTargetAsmPrinter();
+
+                auto machineBuilder = jitOrDie(llvm::orc::JITTargetMachineBuilder::detectHost());
+
+                // Same CPU as the functions are compiled for
+                machineBuilder.setCPU(targetCPU());
+                machineBuilder.getFeatures() = llvm::SubtargetFeatures(targetFeatures());
+
+                auto tier1MachineBuilder = machineBuilder;
+
+                machineBuilder.setCodeGenOptLevel(options_.tieredJit ? llvm::CodeGenOpt::None : codegenOptLevel());
+                tier1MachineBuilder.setCodeGenOptLevel(llvm::CodeGenOpt::Aggressive);
+
+                auto dataLayout = gcDataLayout(jitOrDie(machineBuilder.getDefaultDataLayoutForTarget()));
+
+                if (options_.lazyJit) {
+                    llvm::orc::LLLazyJITBuilder jitBuilder;
+                    jitBuilder.setJITTargetMachineBuilder(std::move(machineBuilder)).setDataLayout(dataLayout);
+
+                    if (options_.gc == GCKind::PRECISE) {
+                        jitBuilder.setObjectLinkingLayerCreator(createStackMapLinkingLayer);
+                    }
+
+                    jit = jitOrDie(jitBuilder.create());
+                } else {
+                    llvm::orc::LLJITBuilder jitBuilder;
+                    jitBuilder.setJITTargetMachineBuilder(std::move(machineBuilder)).setDataLayout(dataLayout);
+
+                    if (options_.gc == GCKind::PRECISE) {
+                        jitBuilder.setObjectLinkingLayerCreator(createStackMapLinkingLayer);
+                    }
+
+                    jit = jitOrDie(jitBuilder.create());
+                }
+
+                if (options_.gc == GCKind::PRECISE) {
+                    addPreciseGCRuntime(*jit);
+                } else {
+                    loadGCRuntime();
+                }
+
+                jit->getMainJITDylib().addGenerator(jitOrDie(
+                    llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+                        jit->getDataLayout().getGlobalPrefix())));
+
+                module->setDataLayout(jit->getDataLayout());
+
+                if (options_.tieredJit) {
+                    auto tier1Level = options_.optLevel == llvm::OptimizationLevel::O0
+                        ? llvm::OptimizationLevel::O3
+                        : options_.optLevel;
+
+                    tieredJit = std::make_unique<TieredJIT>(
+                        *jit, std::move(tier1MachineBuilder),
+                        [this, tier1Level](llvm::Module& hotModule) {
+                            optimize(hotModule, tier1Level, nullptr);
+                            lowerGC(hotModule, nullptr);
+                        },
+                        options_.tierUpThreshold);
+
+                    tieredJit->addModule(std::move(module), std::move(ctx), options_.lazyJit);
+                } else {
+                    llvm::orc::ThreadSafeModule threadSafeModule(std::move(module), std::move(ctx));
+
+                    auto error = options_.lazyJit
+                        ? static_cast<llvm::orc::LLLazyJIT&>(*jit).addLazyIRModule(std::move(threadSafeModule))
+                        : jit->addIRModule(std::move(threadSafeModule));
+
+                    if (error) {
+                        DIE << "JIT: " << llvm::toString(std::move(error));
+                    }
+                }
+            }
+
+            TimeReport::Phase phase(timeReport_.get(), "JIT execution");
+
+            auto mainSymbol = jitOrDie(jit->lookup("main"));
+            auto mainFn = (int (*)())mainSymbol.getAddress();
+
+            llvm::outs().flush();
+
+            auto exitCode = mainFn();
+            fflush(stdout);
+
+            if (tieredJit && timeReport_) {
+                timeReport_->setCount("tiered up functions", tieredJit->tieredUpCount());
+            }
+
+            return exitCode;
+        }
+
+        /**
+         * Precise GC: defines the runtime (linked into the compiler) in the
+         * JIT, and lowers each module for it before compilation.
+        */
+        void addPreciseGCRuntime(llvm::orc::LLJIT& jit) const {
+            auto runtimeSymbol = [](auto function) {
+                return llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(function),
+                                                llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+            };
+
+            auto runtimeVariable = [](auto variable) {
+                return llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(variable), llvm::JITSymbolFlags::Exported);
+            };
+
+            llvm::orc::SymbolMap runtimeSymbols{
+                {jit.mangleAndIntern("eva_gc_alloc"), runtimeSymbol(&eva_gc_alloc)},
+                {jit.mangleAndIntern("eva_gc_alloc_slow"), runtimeSymbol(&eva_gc_alloc_slow)},
+                {jit.mangleAndIntern("eva_gc_write_barrier"), runtimeSymbol(&eva_gc_write_barrier)},
+                {jit.mangleAndIntern("eva_gc_nursery_top"), runtimeVariable(&eva_gc_nursery_top)},
+                {jit.mangleAndIntern("eva_gc_nursery_limit"), runtimeVariable(&eva_gc_nursery_limit)},
+            };
+
+            if (auto error = jit.getMainJITDylib().define(llvm::orc::absoluteSymbols(std::move(runtimeSymbols)))) {
+                DIE << "JIT: " << llvm::toString(std::move(error));
+            }
+
+            jit.getIRTransformLayer().setTransform(
+                [this](llvm::orc::ThreadSafeModule threadSafeModule, const llvm::orc::MaterializationResponsibility&) {
+                    threadSafeModule.withModuleDo([this](llvm::Module& jitModule) { lowerGC(jitModule, nullptr); });
+                    return llvm::Expected<llvm::orc::ThreadSafeModule>(std::move(threadSafeModule));
+                });
+        }
+
+        /**
+         * Object linking layer of the JIT which registers the stack maps of
+         * each object with the GC, once the object is relocated.
+        */
+        static llvm::Expected<std::unique_ptr<llvm::orc::ObjectLayer>> createStackMapLinkingLayer(
+                llvm::orc::ExecutionSession& session, const llvm::Triple&) {
+            auto layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(
+                session, [] { return std::make_unique<llvm::SectionMemoryManager>(); });
+
+            // Loaded (by responsibility), registered when emitted
+            auto stackMaps = std::make_shared<std::map<llvm::orc::MaterializationResponsibility*, std::pair<uint64_t, uint64_t>>>();
+            auto stackMapsMutex = std::make_shared<std::mutex>();
+
+            layer->setNotifyLoaded([=](llvm::orc::MaterializationResponsibility& responsibility,
+                                       const llvm::object::ObjectFile& object,
+                                       const llvm::RuntimeDyld::LoadedObjectInfo& info) {
+                for (auto& section : object.sections()) {
+                    auto name = section.getName();
+
+                    if (name && *name == ".llvm_stackmaps") {
+                        std::lock_guard<std::mutex> lock(*stackMapsMutex);
+                        (*stackMaps)[&responsibility] = {info.getSectionLoadAddress(section), section.getSize()};
+                    }
+                }
+            });
+
+            layer->setNotifyEmitted([=](llvm::orc::MaterializationResponsibility& responsibility,
+                                        std::unique_ptr<llvm::MemoryBuffer>) {
+                std::lock_guard<std::mutex> lock(*stackMapsMutex);
+                auto stackMap = stackMaps->find(&responsibility);
+
+                if (stackMap != stackMaps->end()) {
+                    eva_gc_register_stack_map((const uint8_t*)stackMap->second.first, stackMap->second.second);
+                    stackMaps->erase(stackMap);
+                }
+            });
+
+            return layer;
+        }
+
+        /**
+         * Makes GC_malloc available to the JIT, loading the collector
+         * if the host process is not linked with it. Dies if it cannot:
+         * under the lazy JIT, unresolved symbols are only reported when
+         * a function is first called.
+        */
+        static void loadGCRuntime() {
+            // Symbols of the process itself (and of preloaded libraries)
+            llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+
+            if (llvm::sys::DynamicLibrary::SearchForAddressOfSymbol("GC_malloc") != nullptr) {
+                return;
+            }
+
+            for (auto library : {"libgc.so.1", "libgc.so"}) {
+                if (!llvm::sys::DynamicLibrary::LoadLibraryPermanently(library)) {
+                    return;
+                }
+            }
+
+            DIE << "[EvaLLVM]: Cannot load the Boehm GC (libgc.so.1) for the JIT: "
+                << "install libgc, or use --gc=precise.";
+        }
+
+        /**
+         * Returns the value, or dies with the JIT error.
+        */
+        template <typename T>
+        static T jitOrDie(llvm::Expected<T> value) {
+            if (!value) {
+                DIE << "JIT: " << llvm::toString(value.takeError());
+            }
+
+            return std::move(*value);
+        }
+
+        /**
+         * Output file name, or the default one if not set.
+        */
+        std::string outputFile(const char* defaultName) const {
+            return options_.outputFile.empty() ? defaultName : options_.outputFile;
+        }
+
+        /**
+         * Builds the executable from the incremental cache: only units
+         * which changed are optimized and compiled.
+        */
+        void emitIncremental() {
+            IncrementalCache cache(options_.incrementalCacheDir, incrementalConfiguration());
+
+            if (auto errorCode = llvm::sys::fs::create_directories(cache.directory())) {
+                DIE << "Cannot create the cache directory " << cache.directory() << ": " << errorCode.message();
+            }
+
+            std::vector<std::string> objectFiles;
+            size_t reused = 0;
+            size_t rebuilt = 0;
+
+            std::vector<std::unique_ptr<llvm::Module>> units;
+            std::vector<uint64_t> keys;
+
+            {
+                TimeReport::Phase phase(timeReport_.get(), "incremental cache");
+                units = IncrementalCache::split(*module);
+
+                for (auto& unit : units) {
+                    keys.push_back(cache.key(*unit));
+                }
+            }
+
+            for (size_t i = 0; i < units.size(); i++) {
+                auto objectFile = cache.objectPath(keys[i]);
+                objectFiles.push_back(objectFile);
+
+                if (cache.contains(keys[i])) {
+                    reused++;
+                    continue;
+                }
+
+                {
+                    TimeReport::Phase phase(timeReport_.get(), "optimization");
+                    optimize(*units[i], options_.optLevel, targetMachine_.get());
+                }
+
+                TimeReport::Phase phase(timeReport_.get(), "native codegen");
+
+                // Written aside and renamed, so the cache never has partial objects
+                llvm::SmallString<128> tempFile;
+
+                if (auto errorCode = llvm::sys::fs::createUniqueFile(objectFile + ".%%%%%%.tmp", tempFile)) {
+                    DIE << "Cannot write to the cache " << cache.directory() << ": " << errorCode.message();
+                }
+
+                emitObjectFile(*units[i], *targetMachine_, std::string(tempFile));
+
+                if (auto errorCode = llvm::sys::fs::rename(tempFile, objectFile)) {
+                    DIE << "Cannot write to the cache " << cache.directory() << ": " << errorCode.message();
+                }
+
+                rebuilt++;
+            }
+
+            llvm::errs() << "Incremental cache: " << reused << " reused, " << rebuilt << " rebuilt\n";
+
+            if (timeReport_) {
+                timeReport_->setCount("reused units", reused);
+                timeReport_->setCount("rebuilt units", rebuilt);
+            }
+
+            TimeReport::Phase phase(timeReport_.get(), "linking");
+            linkExecutable(objectFiles, outputFile("./dist/out"));
+        }
+
+        /**
+         * Builds the executable from partitions of the module, which are
+         * optimized and compiled on a thread pool.
+         *
+         * Partitions are cut by SplitModule (functions sharing local symbols
+         * stay together), and each is moved to its own context through
+         * bitcode, so the threads share no IR. Each partition has its own
+         * target machine, which is not thread-safe.
+        */
+        void emitPartitioned() {
+            std::vector<llvm::SmallVector<char, 0>> bitcodes;
+
+            {
+                TimeReport::Phase phase(timeReport_.get(), "module splitting");
+
+                llvm::SplitModule(*module, options_.codegenPartitions, [&](std::unique_ptr<llvm::Module> partition) {
+                    llvm::raw_svector_ostream os(bitcodes.emplace_back());
+                    llvm::WriteBitcodeToFile(*partition, os);
+                });
+            }
+
+            std::vector<std::string> objectFiles;
+
+            for (size_t i = 0; i < bitcodes.size(); i++) {
+                llvm::SmallString<128> objectFile;
+
+                if (auto errorCode = llvm::sys::fs::createTemporaryFile("eva", "o", objectFile)) {
+                    DIE << "Cannot create a temporary object file: " << errorCode.message();
+                }
+
+                objectFiles.emplace_back(objectFile);
+            }
+
+            {
+                TimeReport::Phase phase(timeReport_.get(), "parallel codegen");
+
+                runParallel(bitcodes.size(), [&](size_t i) {
+                    llvm::LLVMContext partitionCtx;
+                    auto bitcode = llvm::StringRef(bitcodes[i].data(), bitcodes[i].size());
+                    auto partition = llvm::parseBitcodeFile(llvm::MemoryBufferRef(bitcode, "partition"), partitionCtx);
+
+                    if (!partition) {
+                        DIE << "Cannot load a module partition: " << llvm::toString(partition.takeError());
+                    }
+
+                    auto machine = createTargetMachine();
+
+                    optimize(**partition, options_.optLevel, machine.get());
+                    emitObjectFile(**partition, *machine, objectFiles[i]);
+                });
+            }
+
+            {
+                TimeReport::Phase phase(timeReport_.get(), "linking");
+                linkExecutable(objectFiles, outputFile("./dist/out"));
+            }
+
+            for (auto& objectFile : objectFiles) {
+                llvm::sys::fs::remove(objectFile);
+            }
+        }
+
+        /**
+         * Builds the executable of a multi-file program with ThinLTO.
+         *
+         * Each file's module is optimized on its own (in parallel, in its own
+         * context) and written as bitcode with a summary of its functions.
+         * The thin link reads the summaries only: it resolves symbols and
+         * decides which functions each module imports from the others, so
+         * small functions of other files can be inlined as if the program
+         * was one module. The backends then optimize and compile each module
+         * with its imports in parallel.
+        */
+        void emitThinLTO() {
+            std::vector<llvm::Module*> fileModules;
+
+            for (auto& imported : importedModules_) {
+                fileModules.push_back(imported.get());
+            }
+
+            fileModules.push_back(module.get());
+
+            std::vector<llvm::SmallVector<char, 0>> bitcodes(fileModules.size());
+            std::vector<llvm::SmallVector<char, 0>> summaryBitcodes(fileModules.size());
+            std::vector<std::string> fileNames;
+
+            {
+                TimeReport::Phase phase(timeReport_.get(), "ThinLTO pre-link");
+
+                for (size_t i = 0; i < fileModules.size(); i++) {
+                    llvm::raw_svector_ostream os(bitcodes[i]);
+                    llvm::WriteBitcodeToFile(*fileModules[i], os);
+                    fileNames.push_back(fileModules[i]->getModuleIdentifier());
+                }
+
+                runParallel(bitcodes.size(), [&](size_t i) {
+                    llvm::LLVMContext fileCtx;
+                    auto bitcode = llvm::StringRef(bitcodes[i].data(), bitcodes[i].size());
+                    auto fileModule = llvm::parseBitcodeFile(llvm::MemoryBufferRef(bitcode, fileNames[i]), fileCtx);
+
+                    if (!fileModule) {
+                        DIE << "Cannot load the module of " << fileNames[i] << ": " << llvm::toString(fileModule.takeError());
+                    }
+
+                    auto machine = createTargetMachine();
+                    optimize(**fileModule, options_.optLevel, machine.get(), /* thinLTOPreLink */ true);
+
+                    // Summaries refer to globals by name (strings are anonymous)
+                    llvm::nameUnamedGlobals(**fileModule);
+
+                    llvm::ProfileSummaryInfo profileSummary(**fileModule);
+                    auto summary = llvm::buildModuleSummaryIndex(**fileModule, nullptr, &profileSummary);
+                    llvm::raw_svector_ostream os(summaryBitcodes[i]);
+                    llvm::WriteBitcodeToFile(**fileModule, os, /* ShouldPreserveUseListOrder */ false, &summary,
+                                             /* GenerateHash */ true);
+                });
+            }
+
+            std::vector<std::string> objectFiles;
+
+            {
+                TimeReport::Phase phase(timeReport_.get(), "ThinLTO backends");
+
+                llvm::lto::Config config;
+                config.CPU = targetCPU();
+                config.RelocModel = llvm::Reloc::PIC_;
+                config.OptLevel = options_.optLevel.getSpeedupLevel();
+                config.CGOptLevel = codegenOptLevel();
+                config.OptPipeline = options_.passPipeline;
+
+                // The precise GC lowers the optimized modules (as lowerGC, but
+                // allocations stay calls: the pipeline is parsed by LTO)
+                if (options_.gc == GCKind::PRECISE) {
+                    auto level = options_.optLevel;
+                    auto levelName = level.getSizeLevel() == 2 ? "Oz" : level.getSizeLevel() == 1 ? "Os" : "O" + std::to_string(level.getSpeedupLevel());
+                    auto pipeline = options_.passPipeline.empty() ? "thinlto<" + levelName + ">" : options_.passPipeline;
+
+                    config.OptPipeline = pipeline + ",function(mem2reg),rewrite-statepoints-for-gc";
+                }
+
+                llvm::SubtargetFeatures features(targetFeatures());
+                config.MAttrs = features.getFeatures();
+
+                llvm::lto::LTO lto(std::move(config),
+                                   llvm::lto::createInProcessThinBackend(llvm::heavyweight_hardware_concurrency()));
+
+                // Symbol resolution of the whole program: each definition
+                // prevails, and only main is referenced by native code
+                llvm::StringSet<> definitions;
+
+                for (size_t i = 0; i < summaryBitcodes.size(); i++) {
+                    auto bitcode = llvm::StringRef(summaryBitcodes[i].data(), summaryBitcodes[i].size());
+                    auto input = llvm::lto::InputFile::create(llvm::MemoryBufferRef(bitcode, fileNames[i]));
+
+                    if (!input) {
+                        DIE << "Cannot load the module of " << fileNames[i] << ": " << llvm::toString(input.takeError());
+                    }
+
+                    std::vector<llvm::lto::SymbolResolution> resolutions;
+
+                    for (auto& symbol : (*input)->symbols()) {
+                        llvm::lto::SymbolResolution resolution;
+
+                        if (!symbol.isUndefined()) {
+                            if (!definitions.insert(symbol.getName()).second) {
+                                DIE << "\"" << symbol.getName().str() << "\" is defined in more than one file.";
+                            }
+
+                            resolution.Prevailing = true;
+                            resolution.FinalDefinitionInLinkageUnit = true;
+                            resolution.VisibleToRegularObj = symbol.getName() == "main";
+                        }
+
+                        resolutions.push_back(resolution);
+                    }
+
+                    if (auto error = lto.add(std::move(*input), resolutions)) {
+                        DIE << "ThinLTO: " << llvm::toString(std::move(error));
+                    }
+                }
+
+                // Tasks write their objects to temporary files (from the backend threads)
+                std::vector<std::string> taskObjectFiles(lto.getMaxTasks());
+
+                auto addStream = [&](unsigned task) -> llvm::Expected<std::unique_ptr<llvm::CachedFileStream>> {
+                    int fd;
+                    llvm::SmallString<128> objectFile;
+
+                    if (auto errorCode = llvm::sys::fs::createTemporaryFile("eva", "o", fd, objectFile)) {
+                        return llvm::errorCodeToError(errorCode);
+                    }
+
+                    taskObjectFiles[task] = std::string(objectFile);
+
+                    return std::make_unique<llvm::CachedFileStream>(
+                        std::make_unique<llvm::raw_fd_ostream>(fd, /* shouldClose */ true));
+                };
+
+                if (auto error = lto.run(addStream)) {
+                    DIE << "ThinLTO: " << llvm::toString(std::move(error));
+                }
+
+                for (auto& objectFile : taskObjectFiles) {
+                    if (!objectFile.empty()) {
+                        objectFiles.push_back(objectFile);
+                    }
+                }
+            }
+
+            {
+                TimeReport::Phase phase(timeReport_.get(), "linking");
+                linkExecutable(objectFiles, outputFile("./dist/out"));
+            }
+
+            for (auto& objectFile : objectFiles) {
+                llvm::sys::fs::remove(objectFile);
+            }
+        }
+
+        /**
+         * Runs body(0) .. body(count - 1) on a thread pool.
+        */
+        static void runParallel(size_t count, const std::function<void(size_t)>& body) {
+            std::atomic<size_t> next{0};
+
+            auto worker = [&]() {
+                for (auto i = next++; i < count; i = next++) {
+                    body(i);
+                }
+            };
+
+            std::vector<std::thread> pool;
+            auto poolSize = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), count);
+
+            for (size_t i = 0; i < poolSize; i++) {
+                pool.emplace_back(worker);
+            }
+
+            for (auto& thread : pool) {
+                thread.join();
+            }
+        }
+
+        /**
+         * Everything besides the IR which affects cached object code.
+        */
+        std::string incrementalConfiguration() const {
+            std::string configuration;
+            llvm::raw_string_ostream os(configuration);
+
+            os << "eva-incremental 1; LLVM " << LLVM_VERSION_STRING
+               << "; " << targetMachine_->getTargetTriple().str()
+               << "; " << targetMachine_->getTargetCPU() << "; " << targetMachine_->getTargetFeatureString()
+               << "; O" << options_.optLevel.getSpeedupLevel() << "s" << options_.optLevel.getSizeLevel()
+               << "; " << options_.passPipeline << "; GC " << (options_.gc == GCKind::PRECISE ? "precise" : "Boehm") << "\n";
+
+            return os.str();
+        }
+
+        /**
+         * Lowers a module to a native object file (GC statepoints first).
+        */
+        void emitObjectFile(llvm::Module& module, llvm::TargetMachine& machine, const std::string& fileName) {
+            std::error_code errorCode;
+            llvm::raw_fd_ostream out(fileName, errorCode, llvm::sys::fs::OF_None);
+
+            if (errorCode) {
+                DIE << "Cannot write " << fileName << ": " << errorCode.message();
+            }
+
+            lowerGC(module, &machine);
+
+            // Code generation still runs on the legacy pass manager
+            llvm::legacy::PassManager codegenPasses;
+
+            if (machine.addPassesToEmitFile(codegenPasses, out, nullptr, llvm::CGFT_ObjectFile)) {
+                DIE << "The target cannot emit object files.";
+            }
+
+            codegenPasses.run(module);
+        }
+
+        /**
+         * Links object files into an executable with the system compiler driver.
+        */
+        void linkExecutable(const std::vector<std::string>& objectFiles, const std::string& exeFile) {
+            auto linker = llvm::sys::findProgramByName("cc");
+
+            if (!linker) {
+                DIE << "Cannot find the system linker driver (cc).";
+            }
+
+            auto gcLib = options_.gcLib;
+
+            // The Eva runtime is built next to the compiler (see compile-run.sh)
+            if (gcLib.empty() && options_.gc == GCKind::PRECISE) {
+                llvm::SmallString<128> runtimePath(llvm::sys::fs::getMainExecutable(nullptr, (void*)&eva_gc_alloc));
+                llvm::sys::path::remove_filename(runtimePath);
+                llvm::sys::path::append(runtimePath, "libevagc.a");
+                gcLib = std::string(runtimePath);
+            } else if (gcLib.empty()) {
+                gcLib = "-lgc";
+            }
+
+            std::vector<llvm::StringRef> args{*linker};
+            args.insert(args.end(), objectFiles.begin(), objectFiles.end());
+            args.insert(args.end(), {"-o", exeFile, gcLib});
+
+            // The runtime is C++. Stack maps hold absolute addresses (text relocations in a PIE)
+            if (options_.gc == GCKind::PRECISE) {
+                args.insert(args.end(), {"-lstdc++", "-no-pie"});
+            }
+
+            std::string errorMessage;
+
+            auto status = llvm::sys::ExecuteAndWait(*linker, args, llvm::None, {}, 0, 0, &errorMessage);
+
+            if (status != 0) {
+                DIE << "Linking " << exeFile << " failed" << (errorMessage.empty() ? "." : ": " + errorMessage);
+            }
+        }
+
         /**
          * Saves the IR to a file
         */
         void saveModuleToFile(const std::string& fileName) {
             std::error_code errorCode;
             llvm::raw_fd_ostream outLL(fileName, errorCode);
+
+            if (errorCode) {
+                DIE << "Cannot write " << fileName << ": " << errorCode.message();
+            }
+
             module->print(outLL, nullptr);
         }
 
+        /**
+         * Saves the module as bitcode to a file
+        */
+        void saveBitcodeToFile(const std::string& fileName) {
+            std::error_code errorCode;
+            llvm::raw_fd_ostream outBC(fileName, errorCode, llvm::sys::fs::OF_None);
+
+            if (errorCode) {
+                DIE << "Cannot write " << fileName << ": " << errorCode.message();
+            }
+
+            llvm::WriteBitcodeToFile(*module, outBC);
+        }
+
         /**
          * Initializes the module
         */
@@ -1017,36 +2927,210 @@ class EvaLLVM {
          * Sets up the Global Environment
         */
         void setupGlobalEnvironment() {
-            std::map<std::string, llvm::Value*> globalObject{
-                {"VERSION", builder->getInt32(42)}
+            std::map<Symbol, llvm::Value*> globalObject{
+                {KW_VERSION, builder->getInt32(42)}
             };
 
-            std::map<std::string, llvm::Value*> globalRec{};
-
             for (auto& entry : globalObject) {
-                globalRec[entry.first] = createGlobalVar(entry.first, (llvm::Constant*)entry.second);
+                env.define(entry.first, createGlobalVar(std::string(symbols().name(entry.first)), (llvm::Constant*)entry.second));
             }
+        }
 
-            GlobalEnv = std::make_shared<Environment>(globalRec, nullptr);
+        /**
+         * Sets up the special forms dispatch table (keyword ID -> handler).
+        */
+        void setupSpecialForms() {
+            specialForms_.fill(nullptr);
+
+            specialForms_[KW_ADD] = &EvaLLVM::genAdd;
+            specialForms_[KW_SUB] = &EvaLLVM::genSub;
+            specialForms_[KW_MUL] = &EvaLLVM::genMul;
+            specialForms_[KW_DIV] = &EvaLLVM::genDiv;
+
+            specialForms_[KW_GT] = &EvaLLVM::genGt;
+            specialForms_[KW_LT] = &EvaLLVM::genLt;
+            specialForms_[KW_EQ] = &EvaLLVM::genEq;
+            specialForms_[KW_NE] = &EvaLLVM::genNe;
+            specialForms_[KW_GE] = &EvaLLVM::genGe;
+            specialForms_[KW_LE] = &EvaLLVM::genLe;
+
+            specialForms_[KW_IF] = &EvaLLVM::genIf;
+            specialForms_[KW_WHILE] = &EvaLLVM::genWhile;
+            specialForms_[KW_DEF] = &EvaLLVM::genDef;
+            specialForms_[KW_VAR] = &EvaLLVM::genVar;
+            specialForms_[KW_SET] = &EvaLLVM::genSet;
+            specialForms_[KW_BEGIN] = &EvaLLVM::genBegin;
+            specialForms_[KW_PRINTF] = &EvaLLVM::genPrintf;
+            specialForms_[KW_CLASS] = &EvaLLVM::genClass;
+            specialForms_[KW_NEW] = &EvaLLVM::genNew;
+            specialForms_[KW_PROP] = &EvaLLVM::genProp;
+            specialForms_[KW_METHOD] = &EvaLLVM::genMethod;
+            specialForms_[KW_IMPORT] = &EvaLLVM::genImport;
+            specialForms_[KW_FINAL] = &EvaLLVM::genFinal;
         }
 
         /**
-         * Sets up target triple.
+         * Sets up target triple (of the host).
         */
         void setupTargetTriple() {
-            // x86_64-pc-linux-gnu | llvm::sys::getDefaultTargetTriple()
-            module->setTargetTriple("x86_64-pc-linux-gnu");
+            module->setTargetTriple(llvm::sys::getDefaultTargetTriple());
+        }
+
+        /**
+         * Sets up the target machine. The module takes its data layout, so
+         * sizes computed in codegen (e.g. of objects) match the target.
+        */
+        void setupTargetMachine() {
+            llvm::InitializeNativeTarget();
+            llvm::InitializeNativeTargetAsmPrinter();
+
+            // Statepoint GC strategy for codegen
+            llvm::linkAllBuiltinGCs();
+
+            targetMachine_ = createTargetMachine();
+            module->setDataLayout(gcDataLayout(targetMachine_->createDataLayout()));
+        }
+
+        /**
+         * Precise GC: objects are non-integral pointers, so the optimizer
+         * does not turn them into integers, which the GC would not see.
+        */
+        llvm::DataLayout gcDataLayout(const llvm::DataLayout& dataLayout) const {
+            if (options_.gc != GCKind::PRECISE) {
+                return dataLayout;
+            }
+
+            return llvm::DataLayout(dataLayout.getStringRepresentation() + "-ni:" + std::to_string(GC_ADDRESS_SPACE));
+        }
+
+        /**
+         * Creates a target machine for the module's target.
+        */
+        std::unique_ptr<llvm::TargetMachine> createTargetMachine() const {
+            auto triple = module->getTargetTriple();
+            std::string error;
+            auto target = llvm::TargetRegistry::lookupTarget(triple, error);
+
+            if (target == nullptr) {
+                DIE << "Cannot emit code for " << triple << ": " << error;
+            }
+
+            checkTargetCPU(target, triple);
+
+            return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+                triple, targetCPU(), targetFeatures(), llvm::TargetOptions(), llvm::Reloc::PIC_,
+                /* code model */ llvm::None, codegenOptLevel()));
+        }
+
+        /**
+         * Checks --mcpu against the target: LLVM ignores an unknown CPU,
+         * and then may abort on a subtarget without the triple's features.
+        */
+        void checkTargetCPU(const llvm::Target* target, const std::string& triple) const {
+            auto subtarget = std::unique_ptr<llvm::MCSubtargetInfo>(target->createMCSubtargetInfo(triple, "", ""));
+
+            if (subtarget == nullptr || !subtarget->isCPUStringValid(targetCPU())) {
+                DIE << "[EvaLLVM]: Unknown CPU " << targetCPU() << " for " << triple << " (--mcpu)";
+            }
+        }
+
+        /**
+         * Target CPU name.
+        */
+        std::string targetCPU() const {
+            if (isNativeCPU()) {
+                return llvm::sys::getHostCPUName().str();
+            }
+
+            return options_.cpu.empty() ? "generic" : options_.cpu;
+        }
+
+        bool isNativeCPU() const {
+            return options_.cpu == "native" || (options_.cpu.empty() && options_.jit);
+        }
+
+        /**
+         * Target features: of the host CPU with --mcpu=native, then --mattr.
+        */
+        std::string targetFeatures() const {
+            llvm::SubtargetFeatures features;
+            llvm::StringMap<bool> hostFeatures;
+
+            if (isNativeCPU() && llvm::sys::getHostCPUFeatures(hostFeatures)) {
+                std::vector<std::string> names;
+
+                for (auto& feature : hostFeatures) {
+                    names.push_back(feature.first().str());
+                }
+
+                // Stable order, the features are part of the IR and cache keys
+                std::sort(names.begin(), names.end());
+
+                for (auto& name : names) {
+                    features.AddFeature(name, hostFeatures[name]);
+                }
+            }
+
+            llvm::SubtargetFeatures requestedFeatures(options_.features);
+
+            for (auto& feature : requestedFeatures.getFeatures()) {
+                features.AddFeature(feature);
+            }
+
+            return features.getString();
         }
 
+        /**
+         * Code generator optimization level, from the pipeline level.
+        */
+        llvm::CodeGenOpt::Level codegenOptLevel() const {
+            switch (options_.optLevel.getSpeedupLevel()) {
+                case 0: return llvm::CodeGenOpt::None;
+                case 1: return llvm::CodeGenOpt::Less;
+                case 2: return llvm::CodeGenOpt::Default;
+                default: return llvm::CodeGenOpt::Aggressive;
+            }
+        }
+
+        /**
+         * Compiler options
+        */
+        CompilerOptions options_;
+
         /**
          * Parser
         */
         std::unique_ptr<EvaParser> parser;
 
         /**
-         * Global Environment (Symbol Table)
+         * Precompiled AST cache, the loaded AST refers to it
+        */
+        std::unique_ptr<AstCache> astCache_;
+
+        /**
+         * Target machine, if native code is emitted
+        */
+        std::unique_ptr<llvm::TargetMachine> targetMachine_;
+
+        /**
+         * Time report, if requested
         */
-        std::shared_ptr<Environment> GlobalEnv;
+        std::unique_ptr<TimeReport> timeReport_;
+
+        /**
+         * Special form handler
+        */
+        using SpecialForm = llvm::Value* (EvaLLVM::*)(const Exp&);
+
+        /**
+         * Special forms dispatch table, indexed by keyword ID
+        */
+        std::array<SpecialForm, KEYWORDS_COUNT> specialForms_;
+
+        /**
+         * Environment (Symbol Table): globals, and scopes of the code being compiled
+        */
+        Environment env;
 
         /**
          * Currently compiling function
@@ -1058,10 +3142,56 @@ class EvaLLVM {
         */
         llvm::StructType* cls = nullptr;
 
+        /**
+         * Real path of the currently compiling file (empty for an expression)
+        */
+        std::string currentFile_;
+
+        /**
+         * Function of the top-level code of the current file (main, or the
+         * init function of an imported file)
+        */
+        llvm::Function* fileInit_ = nullptr;
+
+        /**
+         * Exports of the current file, or nullptr for the program file
+        */
+        std::vector<std::pair<Symbol, llvm::Value*>>* fileExports_ = nullptr;
+
+        /**
+         * External functions
+        */
+        llvm::Function* printfFn;
+        llvm::Function* gcMallocFn;
+        llvm::Function* gcMallocAtomicFn = nullptr;
+        llvm::Function* gcWriteBarrierFn = nullptr;
+
         /**
          * Class Info.
         */
-        std::map<std::string, ClassInfo> classMap_;
+        std::map<Symbol, ClassInfo> classMap_;
+
+        /**
+         * Class Info by class type.
+        */
+        std::map<llvm::StructType*, ClassInfo*> classByType_;
+
+        /**
+         * Method calls through vTables, to devirtualize
+        */
+        std::vector<VirtualCall> virtualCalls_;
+
+        /**
+         * Calls bound statically (final, or by class hierarchy analysis),
+         * and speculatively
+        */
+        size_t devirtualizedCalls_ = 0;
+        size_t speculativeCalls_ = 0;
+
+        /**
+         * Objects moved to the stack by escape analysis (partitions are optimized in parallel)
+        */
+        mutable std::atomic<size_t> stackAllocatedObjects_{0};
 
         std::unique_ptr<llvm::LLVMContext> ctx;
         std::unique_ptr<llvm::Module> module;
@@ -1072,6 +3202,16 @@ class EvaLLVM {
          * This builder always prepends to the beginning of the function entry block
         */
         std::unique_ptr<llvm::IRBuilder<>> varsBuilder;
+
+        /**
+         * Imported files by real path (the program file too, to detect cycles)
+        */
+        std::map<std::string, ImportedFile> imports_;
+
+        /**
+         * Modules of the imported files, dependencies first (destroyed before the context)
+        */
+        std::vector<std::unique_ptr<llvm::Module>> importedModules_;
 };
 
 #endif
\ No newline at end of file
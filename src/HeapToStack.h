@@ -0,0 +1,217 @@
+/**
+ * Escape analysis: stack allocation of non-escaping objects
+*/
+
+#ifndef HeapToStack_h
+#define HeapToStack_h
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/PassManager.h"
+
+/**
+ * Replaces GC_malloc (GC_malloc_atomic, eva_gc_alloc) calls whose
+ * object does not outlive the frame of the function with stack slots
+ * (zeroed, as GC memory is).
+ * SROA then scalar-replaces the object entirely, if its fields are
+ * only accessed directly.
+ *
+ * Objects are created by `new` and initialized by constructors, so the
+ * pass runs after inlining, when most constructors are part of the
+ * function. An object escapes if its pointer is:
+ *
+ *   - stored to memory, returned, or converted to an integer,
+ *   - merged with other pointers (phi, select),
+ *   - passed to a call which may capture it (a call not inlined).
+ *
+ * A stack slot is reused by each execution of the allocation (e.g. in a
+ * loop): an object which does not escape cannot be reached from the
+ * next execution, since this would need a phi or memory.
+ *
+ * The precise GC does not scan the stack slots, so only objects without
+ * object fields (by their type map) are moved there.
+*/
+class HeapToStackPass : public llvm::PassInfoMixin<HeapToStackPass> {
+    public:
+        /**
+         * Larger objects stay on the heap, to bound the frame size
+        */
+        static constexpr uint64_t MAX_OBJECT_SIZE = 1024;
+
+        /**
+         * `stackAllocated` (optional) counts the objects moved to the stack.
+        */
+        explicit HeapToStackPass(std::atomic<size_t>* stackAllocated = nullptr) : stackAllocated_(stackAllocated) {}
+
+        llvm::PreservedAnalyses run(llvm::Function& fn, llvm::FunctionAnalysisManager&) {
+            std::vector<std::pair<llvm::CallInst*, uint64_t>> allocations;
+
+            for (auto& inst : llvm::instructions(fn)) {
+                if (auto call = llvm::dyn_cast<llvm::CallInst>(&inst)) {
+                    auto size = stackAllocatableSize(call);
+
+                    if (size != 0) {
+                        allocations.emplace_back(call, size);
+                    }
+                }
+            }
+
+            if (allocations.empty()) {
+                return llvm::PreservedAnalyses::all();
+            }
+
+            std::vector<llvm::CallBase*> calls;
+
+            for (auto& allocation : allocations) {
+                calls.clear();
+
+                if (escapes(allocation.first, calls)) {
+                    continue;
+                }
+
+                toStack(allocation.first, allocation.second);
+
+                // Tail calls may not access the caller's stack
+                for (auto call : calls) {
+                    if (auto tailCall = llvm::dyn_cast<llvm::CallInst>(call)) {
+                        tailCall->setTailCall(false);
+                    }
+                }
+
+                if (stackAllocated_ != nullptr) {
+                    (*stackAllocated_)++;
+                }
+            }
+
+            llvm::PreservedAnalyses preserved;
+            preserved.preserveSet<llvm::CFGAnalyses>();
+
+            return preserved;
+        }
+
+    private:
+        /**
+         * Size of the object of a GC_malloc(_atomic) of a constant, small size, or
+         * of an eva_gc_alloc of a type map without object fields; 0 otherwise
+        */
+        static uint64_t stackAllocatableSize(llvm::CallInst* call) {
+            auto callee = call->getCalledFunction();
+
+            if (callee == nullptr || call->arg_size() != 1) {
+                return 0;
+            }
+
+            uint64_t size = 0;
+
+            if (callee->getName() == "GC_malloc" || callee->getName() == "GC_malloc_atomic") {
+                if (auto constantSize = llvm::dyn_cast<llvm::ConstantInt>(call->getArgOperand(0))) {
+                    size = constantSize->getZExtValue();
+                }
+            } else if (callee->getName() == "eva_gc_alloc") {
+                // { i64 size, i64 pointerCount, [pointerCount x i64] pointerOffsets }
+                auto typeMap = llvm::dyn_cast<llvm::GlobalVariable>(call->getArgOperand(0)->stripPointerCasts());
+
+                if (typeMap != nullptr && typeMap->hasDefinitiveInitializer()) {
+                    auto objectSize = llvm::dyn_cast<llvm::ConstantInt>(typeMap->getInitializer()->getAggregateElement(0u));
+                    auto pointerCount = llvm::dyn_cast<llvm::ConstantInt>(typeMap->getInitializer()->getAggregateElement(1u));
+
+                    if (objectSize != nullptr && pointerCount != nullptr && pointerCount->isZero()) {
+                        size = objectSize->getZExtValue();
+                    }
+                }
+            }
+
+            return size <= MAX_OBJECT_SIZE ? size : 0;
+        }
+
+        /**
+         * Whether the object may outlive the frame. Collects the calls
+         * the object is passed to (without being captured).
+        */
+        static bool escapes(llvm::Instruction* allocation, std::vector<llvm::CallBase*>& calls) {
+            llvm::SmallPtrSet<llvm::Value*, 16> visited;
+            std::vector<llvm::Value*> pointers{allocation};
+
+            while (!pointers.empty()) {
+                auto pointer = pointers.back();
+                pointers.pop_back();
+
+                if (!visited.insert(pointer).second) {
+                    continue;
+                }
+
+                for (auto& use : pointer->uses()) {
+                    auto user = use.getUser();
+
+                    // Derived pointers: casts, fields
+                    if (llvm::isa<llvm::BitCastInst>(user) || llvm::isa<llvm::AddrSpaceCastInst>(user) ||
+                        llvm::isa<llvm::GetElementPtrInst>(user)) {
+                        pointers.push_back(user);
+                        continue;
+                    }
+
+                    if (llvm::isa<llvm::LoadInst>(user) || llvm::isa<llvm::ICmpInst>(user)) {
+                        continue;
+                    }
+
+                    // Stores to the object, not of it
+                    if (auto store = llvm::dyn_cast<llvm::StoreInst>(user)) {
+                        if (store->getValueOperand() == pointer) {
+                            return true;
+                        }
+
+                        continue;
+                    }
+
+                    if (auto call = llvm::dyn_cast<llvm::CallBase>(user)) {
+                        if (!call->isArgOperand(&use) || !call->doesNotCapture(call->getArgOperandNo(&use))) {
+                            return true;
+                        }
+
+                        calls.push_back(call);
+                        continue;
+                    }
+
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        /**
+         * Replaces the allocation with a zeroed stack slot
+        */
+        static void toStack(llvm::CallInst* allocation, uint64_t size) {
+            auto fn = allocation->getFunction();
+
+            llvm::IRBuilder<> entryBuilder(&fn->getEntryBlock(), fn->getEntryBlock().begin());
+
+            auto objectTy = llvm::ArrayType::get(entryBuilder.getInt8Ty(), size);
+            auto slot = entryBuilder.CreateAlloca(objectTy, nullptr, allocation->getName());
+
+            // GC_malloc alignment
+            slot->setAlignment(llvm::Align(16));
+
+            llvm::IRBuilder<> builder(allocation);
+
+            auto object = builder.CreateConstInBoundsGEP2_32(objectTy, slot, 0, 0);
+            builder.CreateMemSet(object, builder.getInt8(0), size, llvm::MaybeAlign(16));
+
+            // The precise GC's objects are in their own address space
+            allocation->replaceAllUsesWith(builder.CreateAddrSpaceCast(object, allocation->getType()));
+            allocation->eraseFromParent();
+        }
+
+        std::atomic<size_t>* stackAllocated_;
+};
+
+#endif
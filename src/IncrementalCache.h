@@ -0,0 +1,273 @@
+/**
+ * Function-level incremental compilation cache
+*/
+
+#ifndef IncrementalCache_h
+#define IncrementalCache_h
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+/**
+ * Caches object code of a program by units: each function (top-level
+ * functions, closures and class methods) is a unit, and main with the
+ * global variables (vTables, globals) is one more.
+ *
+ * A unit is keyed by the hash of its IR before optimization, together
+ * with the compiler configuration. The IR of a unit contains the
+ * declarations of everything it references, so the key changes when the
+ * unit or a signature it depends on changes. Units are optimized and
+ * compiled in isolation, so their object code depends on nothing else.
+ *
+ * The cache directory holds one object file per key, <key>.o.
+*/
+class IncrementalCache {
+    public:
+        /**
+         * `configuration` is anything besides the IR which affects the
+         * object code: optimization level, target, etc.
+        */
+        IncrementalCache(std::string directory, std::string configuration)
+            : directory_(std::move(directory)), configuration_(std::move(configuration)) {}
+
+        /**
+         * Splits the module into units. The module stays intact, except
+         * local symbols referenced across units are made hidden externals.
+        */
+        static std::vector<std::unique_ptr<llvm::Module>> split(llvm::Module& module) {
+            std::vector<std::unique_ptr<llvm::Module>> units;
+            std::vector<llvm::GlobalValue*> mainUnit;
+
+            promoteLocals(module);
+
+            for (auto& function : module) {
+                if (function.isDeclaration()) {
+                    continue;
+                }
+
+                if (function.getName() == "main") {
+                    mainUnit.push_back(&function);
+                } else {
+                    units.push_back(extract(module, {&function}));
+                }
+            }
+
+            for (auto& variable : module.globals()) {
+                if (!variable.isDeclaration() && !isCloned(variable)) {
+                    mainUnit.push_back(&variable);
+                }
+            }
+
+            units.push_back(extract(module, mainUnit));
+
+            return units;
+        }
+
+        /**
+         * Key of a unit.
+        */
+        uint64_t key(const llvm::Module& unit) const {
+            llvm::SmallVector<char, 0> bitcode(configuration_.begin(), configuration_.end());
+            llvm::raw_svector_ostream os(bitcode);
+            llvm::WriteBitcodeToFile(unit, os);
+
+            return llvm::xxHash64(llvm::StringRef(bitcode.data(), bitcode.size()));
+        }
+
+        /**
+         * Object file of a key (it exists if the unit is cached).
+        */
+        std::string objectPath(uint64_t key) const {
+            std::string path;
+            llvm::raw_string_ostream os(path);
+            os << directory_ << "/" << llvm::format_hex_no_prefix(key, 16) << ".o";
+
+            return os.str();
+        }
+
+        bool contains(uint64_t key) const {
+            return llvm::sys::fs::exists(objectPath(key));
+        }
+
+        const std::string& directory() const { return directory_; }
+
+    private:
+        /**
+         * Constants only used by address-insensitive code (strings) are
+         * cloned into each unit which uses them.
+        */
+        static bool isCloned(const llvm::GlobalVariable& variable) {
+            return variable.hasLocalLinkage() && variable.isConstant() && variable.hasGlobalUnnamedAddr();
+        }
+
+        /**
+         * Other local symbols may be referenced from several units.
+        */
+        static void promoteLocals(llvm::Module& module) {
+            auto promote = [](llvm::GlobalValue& value) {
+                value.setLinkage(llvm::GlobalValue::ExternalLinkage);
+                value.setVisibility(llvm::GlobalValue::HiddenVisibility);
+            };
+
+            for (auto& function : module) {
+                if (function.hasLocalLinkage()) {
+                    promote(function);
+                }
+            }
+
+            for (auto& variable : module.globals()) {
+                if (variable.hasLocalLinkage() && !isCloned(variable)) {
+                    promote(variable);
+
+                    if (!variable.hasName()) {
+                        variable.setName("global");
+                    }
+                }
+            }
+        }
+
+        /**
+         * Adds the globals referenced by a value (through constant expressions).
+        */
+        static void collectGlobals(const llvm::Value* value, llvm::SmallPtrSetImpl<const llvm::Constant*>& visited,
+                                   std::vector<llvm::GlobalValue*>& globals) {
+            auto constant = llvm::dyn_cast<llvm::Constant>(value);
+
+            if (constant == nullptr || !visited.insert(constant).second) {
+                return;
+            }
+
+            if (auto global = llvm::dyn_cast<llvm::GlobalValue>(constant)) {
+                globals.push_back(const_cast<llvm::GlobalValue*>(global));
+
+                // Cloned constants bring their initializers
+                auto variable = llvm::dyn_cast<llvm::GlobalVariable>(global);
+
+                if (variable != nullptr && isCloned(*variable)) {
+                    collectGlobals(variable->getInitializer(), visited, globals);
+                }
+                return;
+            }
+
+            for (auto& operand : constant->operands()) {
+                collectGlobals(operand, visited, globals);
+            }
+        }
+
+        /**
+         * Creates a unit with the definitions, and declarations of the
+         * globals they reference.
+        */
+        static std::unique_ptr<llvm::Module> extract(llvm::Module& module, const std::vector<llvm::GlobalValue*>& definitions) {
+            auto unit = std::make_unique<llvm::Module>(definitions.front()->getName(), module.getContext());
+            unit->setTargetTriple(module.getTargetTriple());
+            unit->setDataLayout(module.getDataLayout());
+
+            // 1. Globals in the order of first reference, so the IR of a
+            // unit does not depend on the rest of the module
+            llvm::SmallPtrSet<const llvm::Constant*, 32> visited;
+            std::vector<llvm::GlobalValue*> globals;
+
+            for (auto definition : definitions) {
+                collectGlobals(definition, visited, globals);
+
+                if (auto function = llvm::dyn_cast<llvm::Function>(definition)) {
+                    for (auto& instruction : llvm::instructions(function)) {
+                        for (auto& operand : instruction.operands()) {
+                            collectGlobals(operand, visited, globals);
+                        }
+                    }
+                } else {
+                    collectGlobals(llvm::cast<llvm::GlobalVariable>(definition)->getInitializer(), visited, globals);
+                }
+            }
+
+            // 2. Declarations (and cloned constants)
+            llvm::ValueToValueMapTy valueMap;
+
+            for (auto global : globals) {
+                if (auto function = llvm::dyn_cast<llvm::Function>(global)) {
+                    auto declaration = llvm::Function::Create(
+                        function->getFunctionType(), llvm::GlobalValue::ExternalLinkage, function->getName(), *unit);
+                    declaration->copyAttributesFrom(function);
+                    declaration->setLinkage(llvm::GlobalValue::ExternalLinkage);
+                    valueMap[function] = declaration;
+                    continue;
+                }
+
+                auto variable = llvm::cast<llvm::GlobalVariable>(global);
+                auto cloned = isCloned(*variable);
+
+                auto declaration = new llvm::GlobalVariable(
+                    *unit, variable->getValueType(), variable->isConstant(),
+                    cloned ? variable->getLinkage() : llvm::GlobalValue::ExternalLinkage,
+                    /* Initializer */ nullptr,
+                    // Cloned constants are numbered by the unit
+                    cloned ? "" : variable->getName());
+
+                declaration->copyAttributesFrom(variable);
+
+                if (!cloned) {
+                    declaration->setLinkage(llvm::GlobalValue::ExternalLinkage);
+                }
+
+                valueMap[variable] = declaration;
+            }
+
+            // 3. Definitions
+            for (auto global : globals) {
+                auto variable = llvm::dyn_cast<llvm::GlobalVariable>(global);
+
+                if (variable != nullptr && isCloned(*variable)) {
+                    auto clone = llvm::cast<llvm::GlobalVariable>(valueMap[variable]);
+                    clone->setInitializer(llvm::MapValue(variable->getInitializer(), valueMap));
+                }
+            }
+
+            for (auto definition : definitions) {
+                if (auto variable = llvm::dyn_cast<llvm::GlobalVariable>(definition)) {
+                    auto clone = llvm::cast<llvm::GlobalVariable>(valueMap[variable]);
+                    clone->setInitializer(llvm::MapValue(variable->getInitializer(), valueMap));
+                    clone->setLinkage(variable->getLinkage());
+                    continue;
+                }
+
+                auto function = llvm::cast<llvm::Function>(definition);
+                auto clone = llvm::cast<llvm::Function>(valueMap[function]);
+
+                auto cloneArg = clone->arg_begin();
+
+                for (auto& arg : function->args()) {
+                    cloneArg->setName(arg.getName());
+                    valueMap[&arg] = &*cloneArg++;
+                }
+
+                llvm::SmallVector<llvm::ReturnInst*, 4> returns;
+                llvm::CloneFunctionInto(clone, function, valueMap, llvm::CloneFunctionChangeType::DifferentModule, returns);
+                clone->setLinkage(function->getLinkage());
+            }
+
+            return unit;
+        }
+
+        std::string directory_;
+
+        std::string configuration_;
+};
+
+#endif
@@ -0,0 +1,155 @@
+/**
+ * Precise GC: inlined nursery allocation
+*/
+
+#ifndef InlineAllocation_h
+#define InlineAllocation_h
+
+#include <cstdint>
+#include <vector>
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+/**
+ * Replaces eva_gc_alloc calls with the runtime's fast path: a bump of
+ * the nursery's allocation pointer and a limit check, with a call of
+ * eva_gc_alloc_slow when the nursery is full (see EvaGC.h).
+ *
+ * It runs when the GC is lowered, after optimization: the optimizer
+ * sees the allocations as calls (which are moved to the stack, or
+ * removed, by escape analysis), and only the remaining ones are inlined.
+ *
+ * Allocations whose type map is not in the module (a class of another
+ * file) stay calls.
+*/
+class InlineAllocationPass : public llvm::PassInfoMixin<InlineAllocationPass> {
+    public:
+        /**
+         * Object size (with the header) above which the runtime
+         * allocates in the old generation: a quarter of the smallest
+         * nursery.
+        */
+        static constexpr uint64_t MAX_OBJECT_SIZE = 1024;
+
+        static constexpr uint64_t HEADER_SIZE = 8;
+
+        llvm::PreservedAnalyses run(llvm::Module& module, llvm::ModuleAnalysisManager&) {
+            std::vector<std::pair<llvm::CallInst*, uint64_t>> allocations;
+
+            for (auto& fn : module) {
+                for (auto& inst : llvm::instructions(fn)) {
+                    if (auto call = llvm::dyn_cast<llvm::CallInst>(&inst)) {
+                        auto size = inlineableSize(call);
+
+                        if (size != 0) {
+                            allocations.emplace_back(call, size);
+                        }
+                    }
+                }
+            }
+
+            if (allocations.empty()) {
+                return llvm::PreservedAnalyses::all();
+            }
+
+            auto allocFn = allocations.front().first->getCalledFunction();
+            auto objectPtrTy = allocFn->getReturnType();
+
+            // char* eva_gc_nursery_top, eva_gc_nursery_limit (as object pointers)
+            auto top = module.getOrInsertGlobal("eva_gc_nursery_top", objectPtrTy);
+            auto limit = module.getOrInsertGlobal("eva_gc_nursery_limit", objectPtrTy);
+
+            // void* eva_gc_alloc_slow(const EvaTypeMap* typeMap)
+            auto slowFn = llvm::cast<llvm::Function>(
+                module.getOrInsertFunction("eva_gc_alloc_slow", allocFn->getFunctionType()).getCallee());
+            slowFn->setAttributes(allocFn->getAttributes());
+            slowFn->addFnAttr(llvm::Attribute::Cold);
+
+            for (auto& allocation : allocations) {
+                inlineAllocation(allocation.first, allocation.second, top, limit, slowFn);
+            }
+
+            return llvm::PreservedAnalyses::none();
+        }
+
+    private:
+        /**
+         * Size of the object with its header, of an eva_gc_alloc of a type
+         * map of the module; 0 if it is not inlined
+        */
+        static uint64_t inlineableSize(llvm::CallInst* call) {
+            auto callee = call->getCalledFunction();
+
+            if (callee == nullptr || callee->getName() != "eva_gc_alloc" || call->arg_size() != 1) {
+                return 0;
+            }
+
+            // { i64 size, i64 pointerCount, [pointerCount x i64] pointerOffsets }
+            auto typeMap = llvm::dyn_cast<llvm::GlobalVariable>(call->getArgOperand(0)->stripPointerCasts());
+
+            if (typeMap == nullptr || !typeMap->hasDefinitiveInitializer()) {
+                return 0;
+            }
+
+            auto size = llvm::dyn_cast<llvm::ConstantInt>(typeMap->getInitializer()->getAggregateElement(0u));
+
+            if (size == nullptr) {
+                return 0;
+            }
+
+            auto objectSize = HEADER_SIZE + ((size->getZExtValue() + 7) & ~uint64_t(7));
+
+            return objectSize <= MAX_OBJECT_SIZE ? objectSize : 0;
+        }
+
+        /**
+         * Bumps the allocation pointer if the object fits, or calls the
+         * slow path (likely not taken)
+        */
+        static void inlineAllocation(llvm::CallInst* allocation, uint64_t size, llvm::Constant* top,
+                                     llvm::Constant* limit, llvm::Function* slowFn) {
+            auto objectPtrTy = allocation->getType();
+            auto typeMap = allocation->getArgOperand(0);
+
+            llvm::IRBuilder<> builder(allocation);
+
+            auto object = builder.CreateLoad(objectPtrTy, top, "top");
+            auto next = builder.CreateConstInBoundsGEP1_64(builder.getInt8Ty(), object, size, "next");
+            auto fits = builder.CreateICmpULE(next, builder.CreateLoad(objectPtrTy, limit, "limit"));
+
+            llvm::Instruction* fastTerm;
+            llvm::Instruction* slowTerm;
+
+            // Weights of __builtin_expect
+            llvm::SplitBlockAndInsertIfThenElse(fits, allocation, &fastTerm, &slowTerm,
+                                                llvm::MDBuilder(allocation->getContext()).createBranchWeights(2000, 1));
+
+            // Fast path: the nursery is zeroed, only the header is set
+            builder.SetInsertPoint(fastTerm);
+            builder.CreateStore(next, top);
+
+            auto header = builder.CreateConstGEP1_64(builder.getInt8Ty(), object, -int64_t(HEADER_SIZE));
+            builder.CreateStore(typeMap, builder.CreateBitCast(header, typeMap->getType()->getPointerTo(objectPtrTy->getPointerAddressSpace())));
+
+            builder.SetInsertPoint(slowTerm);
+            auto slowObject = builder.CreateCall(slowFn, typeMap);
+
+            builder.SetInsertPoint(allocation);
+            auto phi = builder.CreatePHI(objectPtrTy, 2);
+            phi->addIncoming(object, fastTerm->getParent());
+            phi->addIncoming(slowObject, slowTerm->getParent());
+
+            phi->takeName(allocation);
+            allocation->replaceAllUsesWith(phi);
+            allocation->eraseFromParent();
+        }
+};
+
+#endif
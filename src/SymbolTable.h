@@ -0,0 +1,197 @@
+/**
+ * Symbol Table (interned identifiers)
+*/
+
+#ifndef SymbolTable_h
+#define SymbolTable_h
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * Interned symbol: a compact ID of an identifier.
+*/
+using Symbol = uint32_t;
+
+/**
+ * Keywords and well-known names, interned with fixed IDs.
+*/
+#define EVA_KEYWORDS(KW)            \
+    KW(ADD, "+")                    \
+    KW(SUB, "-")                    \
+    KW(MUL, "*")                    \
+    KW(DIV, "/")                    \
+    KW(GT, ">")                     \
+    KW(LT, "<")                     \
+    KW(EQ, "==")                    \
+    KW(NE, "!=")                    \
+    KW(GE, ">=")                    \
+    KW(LE, "<=")                    \
+    KW(IF, "if")                    \
+    KW(WHILE, "while")              \
+    KW(DEF, "def")                  \
+    KW(VAR, "var")                  \
+    KW(SET, "set")                  \
+    KW(BEGIN, "begin")              \
+    KW(PRINTF, "printf")            \
+    KW(CLASS, "class")              \
+    KW(NEW, "new")                  \
+    KW(PROP, "prop")                \
+    KW(METHOD, "method")            \
+    KW(IMPORT, "import")            \
+    KW(FINAL, "final")              \
+    KW(SUPER, "super")              \
+    KW(TRUE, "true")                \
+    KW(FALSE, "false")              \
+    KW(NULL, "null")                \
+    KW(ARROW, "->")                 \
+    KW(SELF, "self")                \
+    KW(NUMBER, "number")            \
+    KW(STRING, "string")            \
+    KW(CONSTRUCTOR, "constructor")  \
+    KW(CALL, "__call__")            \
+    KW(VERSION, "VERSION")
+
+enum Keyword : Symbol {
+#define KW_ENUM(id, name) KW_##id,
+    EVA_KEYWORDS(KW_ENUM)
+#undef KW_ENUM
+    KEYWORDS_COUNT
+};
+
+class SymbolTable {
+    public:
+        SymbolTable() {
+#define KW_INTERN(id, name) intern(name);
+            EVA_KEYWORDS(KW_INTERN)
+#undef KW_INTERN
+        }
+
+        /**
+         * Returns the ID of a name, allocating a new one on first use.
+         * Thread-safe: sources can be parsed in parallel.
+        */
+        Symbol intern(std::string_view name) {
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex_);
+                auto it = ids_.find(name);
+
+                if (it != ids_.end()) {
+                    return it->second;
+                }
+            }
+
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+
+            // Could be interned by another thread meanwhile
+            auto it = ids_.find(name);
+
+            if (it != ids_.end()) {
+                return it->second;
+            }
+
+            // Names are stored once, views into the storage are stable
+            auto& stored = names_.emplace_back(name);
+            Symbol id = names_.size() - 1;
+            ids_.emplace(stored, id);
+
+            return id;
+        }
+
+        /**
+         * Returns the name of a symbol.
+        */
+        std::string_view name(Symbol id) const {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            return names_[id];
+        }
+
+        /**
+         * Number of interned symbols.
+        */
+        size_t size() const {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            return names_.size();
+        }
+
+    private:
+        mutable std::shared_mutex mutex_;
+
+        /**
+         * Name -> ID
+        */
+        std::unordered_map<std::string_view, Symbol> ids_;
+
+        /**
+         * ID -> Name
+        */
+        std::deque<std::string> names_;
+};
+
+/**
+ * Process-wide symbol table.
+*/
+inline SymbolTable& symbols() {
+    static SymbolTable table;
+    return table;
+}
+
+/**
+ * Map keyed by symbols, which preserves insertion order. Used for class
+ * fields and methods, where the order defines the struct and vTable layout.
+*/
+template <typename T>
+class SymbolMap {
+    public:
+        using Entry = std::pair<Symbol, T>;
+
+        static constexpr size_t npos = -1;
+
+        /**
+         * Returns the value of a key, appending a new entry if it does not exist.
+        */
+        T& operator[](Symbol key) {
+            auto idx = indexOf(key);
+
+            if (idx == npos) {
+                index_.emplace(key, entries_.size());
+                return entries_.emplace_back(key, T{}).second;
+            }
+
+            return entries_[idx].second;
+        }
+
+        /**
+         * Returns the position of a key, or npos if it does not exist.
+        */
+        size_t indexOf(Symbol key) const {
+            auto it = index_.find(key);
+            return it == index_.end() ? npos : it->second;
+        }
+
+        /**
+         * Returns a pointer to the value of a key, or nullptr.
+        */
+        T* find(Symbol key) {
+            auto idx = indexOf(key);
+            return idx == npos ? nullptr : &entries_[idx].second;
+        }
+
+        size_t size() const { return entries_.size(); }
+
+        typename std::vector<Entry>::const_iterator begin() const { return entries_.begin(); }
+        typename std::vector<Entry>::const_iterator end() const { return entries_.end(); }
+
+    private:
+        std::vector<Entry> entries_;
+        std::unordered_map<Symbol, size_t> index_;
+};
+
+#endif
@@ -0,0 +1,458 @@
+/**
+ * Tiered JIT: baseline code first, optimized code for hot functions
+*/
+
+#ifndef TieredJIT_h
+#define TieredJIT_h
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include "Logger.h"
+
+/**
+ * Runs a module in two tiers.
+ *
+ * Tier 0: every function `f` (except main) is compiled unoptimized as
+ * `f.tier0`, with a counter incremented on entry and on loop backedges.
+ * All calls and references go to `f`, an indirect stub which initially
+ * points to `f.tier0`.
+ *
+ * Tier 1: when the counter of a function reaches the threshold, the
+ * function is cloned from an uninstrumented copy of the module, optimized
+ * and compiled on a background thread, and the stub is patched to the
+ * new code. Its direct callees are cloned as available_externally, so
+ * they can be inlined.
+ *
+ * main runs once, so it stays in tier 0 (there is no on-stack replacement).
+*/
+class TieredJIT {
+    public:
+        /**
+         * Optimizes a tier 1 module in place (and prepares it for codegen).
+        */
+        using Optimizer = std::function<void(llvm::Module&)>;
+
+        TieredJIT(llvm::orc::LLJIT& jit, llvm::orc::JITTargetMachineBuilder machineBuilder,
+                  Optimizer optimize, uint32_t threshold)
+            : jit_(jit), machineBuilder_(std::move(machineBuilder)),
+              optimize_(std::move(optimize)), threshold_(threshold) {}
+
+        ~TieredJIT() {
+            {
+                std::lock_guard<std::mutex> lock(queueMutex_);
+                stop_ = true;
+            }
+
+            queueChanged_.notify_one();
+
+            if (worker_.joinable()) {
+                worker_.join();
+            }
+        }
+
+        TieredJIT(const TieredJIT&) = delete;
+        TieredJIT& operator=(const TieredJIT&) = delete;
+
+        /**
+         * Adds the module in tier 0. Lazy: tier 0 functions are compiled
+         * on their first call, the JIT should be an LLLazyJIT.
+        */
+        void addModule(std::unique_ptr<llvm::Module> module, std::unique_ptr<llvm::LLVMContext> ctx, bool lazy) {
+            auto& dylib = jit_.getMainJITDylib();
+
+            promoteLocals(*module);
+
+            for (auto& function : *module) {
+                if (!function.isDeclaration() && function.getName() != "main") {
+                    functions_.push_back(function.getName().str());
+                }
+            }
+
+            queued_.assign(functions_.size(), false);
+
+            // Copy for tier 1, before the instrumentation
+            context_ = llvm::orc::ThreadSafeContext(std::move(ctx));
+            pristine_ = llvm::CloneModule(*module);
+
+            instrument(*module);
+
+            // Stubs of all functions, patched once their code is known
+            auto stubsManagerBuilder = llvm::orc::createLocalIndirectStubsManagerBuilder(
+                llvm::Triple(module->getTargetTriple()));
+
+            if (!stubsManagerBuilder) {
+                DIE << "Tiered JIT is not supported for " << module->getTargetTriple();
+            }
+
+            stubs_ = stubsManagerBuilder();
+
+            llvm::orc::IndirectStubsManager::StubInitsMap stubInits;
+
+            for (auto& name : functions_) {
+                stubInits[*jit_.mangleAndIntern(name)] = {0, llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable};
+            }
+
+            check(stubs_->createStubs(stubInits));
+
+            llvm::orc::SymbolMap runtimeSymbols;
+
+            for (auto& name : functions_) {
+                auto mangled = jit_.mangleAndIntern(name);
+                runtimeSymbols[mangled] = stubs_->findStub(*mangled, /* ExportedStubsOnly */ true);
+            }
+
+            runtimeSymbols[jit_.mangleAndIntern("__eva_tier_up")] = llvm::JITEvaluatedSymbol(
+                llvm::pointerToJITTargetAddress(&tierUp), llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+
+            check(dylib.define(llvm::orc::absoluteSymbols(std::move(runtimeSymbols))));
+
+            // Tier 0 code (under lazy JIT: lazy reexports, compiled on first call)
+            llvm::orc::ThreadSafeModule tier0(std::move(module), context_);
+
+            if (lazy) {
+                check(static_cast<llvm::orc::LLLazyJIT&>(jit_).addLazyIRModule(std::move(tier0)));
+            } else {
+                check(jit_.addIRModule(std::move(tier0)));
+            }
+
+            llvm::orc::SymbolLookupSet tier0Names;
+
+            for (auto& name : functions_) {
+                tier0Names.add(jit_.mangleAndIntern(name + ".tier0"));
+            }
+
+            auto tier0Symbols = jit_.getExecutionSession().lookup(
+                llvm::orc::makeJITDylibSearchOrder(&dylib), std::move(tier0Names));
+
+            if (!tier0Symbols) {
+                DIE << "JIT: " << llvm::toString(tier0Symbols.takeError());
+            }
+
+            for (auto& name : functions_) {
+                auto address = (*tier0Symbols)[jit_.mangleAndIntern(name + ".tier0")].getAddress();
+                check(stubs_->updatePointer(*jit_.mangleAndIntern(name), address));
+            }
+
+            worker_ = std::thread(&TieredJIT::work, this);
+        }
+
+        /**
+         * Number of functions recompiled in tier 1 so far.
+        */
+        size_t tieredUpCount() const {
+            std::lock_guard<std::mutex> lock(queueMutex_);
+            return tieredUp_;
+        }
+
+    private:
+        /**
+         * Called by tier 0 code when the counter of a function reaches the threshold.
+        */
+        static void tierUp(TieredJIT* self, int32_t id) {
+            {
+                std::lock_guard<std::mutex> lock(self->queueMutex_);
+
+                if (self->queued_[id]) {
+                    return;
+                }
+
+                self->queued_[id] = true;
+                self->queue_.push_back(id);
+            }
+
+            self->queueChanged_.notify_one();
+        }
+
+        /**
+         * Background thread: recompiles the queued functions.
+        */
+        void work() {
+            auto machine = machineBuilder_.createTargetMachine();
+
+            if (!machine) {
+                llvm::errs() << "Tiered JIT: " << llvm::toString(machine.takeError()) << "\n";
+                return;
+            }
+
+            while (true) {
+                int32_t id;
+
+                {
+                    std::unique_lock<std::mutex> lock(queueMutex_);
+                    queueChanged_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+
+                    if (stop_) {
+                        return;
+                    }
+
+                    id = queue_.front();
+                    queue_.erase(queue_.begin());
+                }
+
+                if (recompile(**machine, functions_[id])) {
+                    std::lock_guard<std::mutex> lock(queueMutex_);
+                    tieredUp_++;
+                }
+            }
+        }
+
+        /**
+         * Compiles the tier 1 code of a function and patches its stub.
+        */
+        bool recompile(llvm::TargetMachine& machine, const std::string& name) {
+            std::unique_ptr<llvm::MemoryBuffer> object;
+
+            {
+                // The module shares the context with the running tier 0 code
+                auto lock = context_.getLock();
+
+                auto hotFunction = pristine_->getFunction(name);
+                llvm::SmallPtrSet<const llvm::GlobalValue*, 16> definitions{hotFunction};
+
+                for (auto& instruction : llvm::instructions(hotFunction)) {
+                    if (auto call = llvm::dyn_cast<llvm::CallBase>(&instruction)) {
+                        auto callee = call->getCalledFunction();
+
+                        if (callee != nullptr && !callee->isDeclaration() && callee->getName() != "main") {
+                            definitions.insert(callee);
+                        }
+                    }
+                }
+
+                llvm::ValueToValueMapTy valueMap;
+
+                auto tier1 = llvm::CloneModule(*pristine_, valueMap, [&](const llvm::GlobalValue* value) {
+                    if (auto variable = llvm::dyn_cast<llvm::GlobalVariable>(value)) {
+                        return variable->isConstant() && variable->hasLocalLinkage();
+                    }
+
+                    return definitions.count(value) != 0;
+                });
+
+                for (auto& function : *tier1) {
+                    if (!function.isDeclaration()) {
+                        function.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+                    }
+                }
+
+                auto hotClone = tier1->getFunction(name);
+                hotClone->setName(name + ".tier1");
+                hotClone->setLinkage(llvm::GlobalValue::ExternalLinkage);
+
+                optimize_(*tier1);
+
+                auto compiled = llvm::orc::SimpleCompiler(machine)(*tier1);
+
+                if (!compiled) {
+                    llvm::errs() << "Tiered JIT: " << llvm::toString(compiled.takeError()) << "\n";
+                    return false;
+                }
+
+                object = std::move(*compiled);
+            }
+
+            if (auto error = jit_.addObjectFile(std::move(object))) {
+                llvm::errs() << "Tiered JIT: " << llvm::toString(std::move(error)) << "\n";
+                return false;
+            }
+
+            auto symbol = jit_.lookup(name + ".tier1");
+
+            if (!symbol) {
+                llvm::errs() << "Tiered JIT: " << llvm::toString(symbol.takeError()) << "\n";
+                return false;
+            }
+
+            // An aligned pointer store: calls in flight see the old or the new code
+            if (auto error = stubs_->updatePointer(*jit_.mangleAndIntern(name), symbol->getAddress())) {
+                llvm::errs() << "Tiered JIT: " << llvm::toString(std::move(error)) << "\n";
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Local symbols are referenced across tiers, so they are made external
+         * (and visible, hidden symbols are not looked up in the JIT).
+        */
+        static void promoteLocals(llvm::Module& module) {
+            for (auto& function : module) {
+                if (function.hasLocalLinkage()) {
+                    function.setLinkage(llvm::GlobalValue::ExternalLinkage);
+                }
+
+                function.setVisibility(llvm::GlobalValue::DefaultVisibility);
+            }
+
+            // Local constants are cloned into tier 1 instead
+            for (auto& variable : module.globals()) {
+                if (variable.hasLocalLinkage() && !variable.isConstant()) {
+                    variable.setLinkage(llvm::GlobalValue::ExternalLinkage);
+
+                    if (!variable.hasName()) {
+                        variable.setName("global");
+                    }
+                }
+
+                if (!variable.hasLocalLinkage()) {
+                    variable.setVisibility(llvm::GlobalValue::DefaultVisibility);
+                }
+            }
+        }
+
+        /**
+         * Renames functions to their tier 0 names, redirects all uses to the
+         * stubs, and adds the counters.
+        */
+        void instrument(llvm::Module& module) {
+            auto& ctx = module.getContext();
+            llvm::IRBuilder<> builder(ctx);
+
+            auto tierUpFn = module.getOrInsertFunction("__eva_tier_up", llvm::FunctionType::get(
+                builder.getVoidTy(), {builder.getInt8PtrTy(), builder.getInt32Ty()}, /* vararg */ false));
+
+            // Not a GC safepoint (it does not allocate)
+            llvm::cast<llvm::Function>(tierUpFn.getCallee())->addFnAttr("gc-leaf-function");
+
+            auto self = llvm::ConstantExpr::getIntToPtr(
+                builder.getInt64((uint64_t)this), builder.getInt8PtrTy());
+
+            for (size_t id = 0; id < functions_.size(); id++) {
+                auto& name = functions_[id];
+                auto function = module.getFunction(name);
+
+                function->setName(name + ".tier0");
+
+                auto stub = llvm::Function::Create(
+                    function->getFunctionType(), llvm::GlobalValue::ExternalLinkage, name, module);
+                function->replaceAllUsesWith(stub);
+
+                auto counter = new llvm::GlobalVariable(
+                    module, builder.getInt32Ty(), /* isConstant */ false, llvm::GlobalValue::InternalLinkage,
+                    builder.getInt32(0), name + ".counter");
+
+                // Entry and loop backedges. Variables are allocated along the
+                // entry block (between stores), so its allocas are moved to the
+                // top first: they must stay in the entry block to remain static
+                // (and to be promoted for the precise GC)
+                std::vector<llvm::Instruction*> points;
+
+                auto& entry = function->getEntryBlock();
+                std::vector<llvm::AllocaInst*> allocas;
+
+                for (auto& inst : entry) {
+                    auto alloca = llvm::dyn_cast<llvm::AllocaInst>(&inst);
+
+                    if (alloca != nullptr && llvm::isa<llvm::Constant>(alloca->getArraySize())) {
+                        allocas.push_back(alloca);
+                    }
+                }
+
+                for (auto alloca = allocas.rbegin(); alloca != allocas.rend(); alloca++) {
+                    (*alloca)->moveBefore(&entry.front());
+                }
+
+                auto entryPoint = entry.getFirstNonPHIOrDbgOrLifetime();
+
+                while (llvm::isa<llvm::AllocaInst>(entryPoint)) {
+                    entryPoint = entryPoint->getNextNode();
+                }
+
+                points.push_back(entryPoint);
+
+                llvm::DominatorTree dominators(*function);
+                llvm::LoopInfo loops(dominators);
+
+                for (auto loop : loops.getLoopsInPreorder()) {
+                    llvm::SmallVector<llvm::BasicBlock*, 4> latches;
+                    loop->getLoopLatches(latches);
+
+                    for (auto latch : latches) {
+                        points.push_back(latch->getTerminator());
+                    }
+                }
+
+                for (auto point : points) {
+                    builder.SetInsertPoint(point);
+
+                    auto count = builder.CreateAdd(builder.CreateLoad(builder.getInt32Ty(), counter), builder.getInt32(1));
+                    builder.CreateStore(count, counter);
+
+                    auto isHot = builder.CreateICmpEQ(count, builder.getInt32(threshold_));
+                    auto tierUpCall = llvm::SplitBlockAndInsertIfThen(isHot, point, /* Unreachable */ false);
+
+                    builder.SetInsertPoint(tierUpCall);
+                    builder.CreateCall(tierUpFn, {self, builder.getInt32(id)});
+                }
+            }
+        }
+
+        void check(llvm::Error error) {
+            if (error) {
+                DIE << "JIT: " << llvm::toString(std::move(error));
+            }
+        }
+
+        llvm::orc::LLJIT& jit_;
+
+        /**
+         * Target machine of tier 1 code (owned by the worker).
+        */
+        llvm::orc::JITTargetMachineBuilder machineBuilder_;
+
+        Optimizer optimize_;
+
+        /**
+         * Calls and loop iterations after which a function is recompiled.
+        */
+        uint32_t threshold_;
+
+        /**
+         * Context of all modules, its lock guards the IR.
+        */
+        llvm::orc::ThreadSafeContext context_;
+
+        /**
+         * Uninstrumented module, tier 1 functions are cloned from it.
+        */
+        std::unique_ptr<llvm::Module> pristine_;
+
+        /**
+         * Tiered functions, indexed by ID.
+        */
+        std::vector<std::string> functions_;
+
+        std::unique_ptr<llvm::orc::IndirectStubsManager> stubs_;
+
+        mutable std::mutex queueMutex_;
+        std::condition_variable queueChanged_;
+        std::vector<int32_t> queue_;
+        std::vector<bool> queued_;
+        size_t tieredUp_ = 0;
+        bool stop_ = false;
+
+        std::thread worker_;
+};
+
+#endif
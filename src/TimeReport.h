@@ -0,0 +1,226 @@
+/**
+ * Compile time report (--time-report)
+*/
+
+#ifndef TimeReport_h
+#define TimeReport_h
+
+#include <sys/resource.h>
+
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+
+/**
+ * Wall and CPU time of the compiler phases, and statistics of the
+ * compiled program. Printed as a table, or as JSON to track compiler
+ * performance over time.
+*/
+class TimeReport {
+    public:
+        /**
+         * Wall and CPU (user + system, all threads) time.
+        */
+        struct Times {
+            std::chrono::nanoseconds wall{0};
+            std::chrono::nanoseconds cpu{0};
+
+            Times operator-(const Times& other) const { return {wall - other.wall, cpu - other.cpu}; }
+
+            double wallMs() const { return wall.count() / 1e6; }
+            double cpuMs() const { return cpu.count() / 1e6; }
+
+            int64_t wallUs() const { return wall.count() / 1000; }
+            int64_t cpuUs() const { return cpu.count() / 1000; }
+        };
+
+        static Times now() {
+            llvm::sys::TimePoint<> elapsed;
+            std::chrono::nanoseconds user, system;
+            llvm::sys::Process::GetTimeUsage(elapsed, user, system);
+
+            return {elapsed.time_since_epoch(), user + system};
+        }
+
+        /**
+         * Measures a phase for the lifetime of the guard. A null report
+         * measures nothing, so phases can be marked unconditionally.
+        */
+        class Phase {
+            public:
+                Phase(TimeReport* report, const char* name) : report_(report), name_(name) {
+                    if (report_ != nullptr) {
+                        start_ = now();
+                    }
+                }
+
+                ~Phase() {
+                    if (report_ != nullptr) {
+                        report_->addPhase(name_, now() - start_);
+                    }
+                }
+
+                Phase(const Phase&) = delete;
+                Phase& operator=(const Phase&) = delete;
+
+            private:
+                TimeReport* report_;
+                const char* name_;
+                Times start_;
+        };
+
+        TimeReport() : start_(now()) {}
+
+        /**
+         * Records a statistic of the compiled program.
+        */
+        void setCount(const char* name, uint64_t value) {
+            for (auto& count : counts_) {
+                if (count.first == name) {
+                    count.second = value;
+                    return;
+                }
+            }
+
+            counts_.emplace_back(name, value);
+        }
+
+        /**
+         * Ends the report: the total time and peak RSS are taken once, so
+         * the table and the JSON agree.
+        */
+        void stop() {
+            if (!stopped_) {
+                total_ = now() - start_;
+                peakRssKb_ = peakRssKb();
+                stopped_ = true;
+            }
+        }
+
+        /**
+         * Prints the report as a table.
+        */
+        void print(llvm::raw_ostream& os) {
+            stop();
+
+            os << "===" << std::string(60, '-') << "===\n"
+               << "                     Eva compile time report\n"
+               << "===" << std::string(60, '-') << "===\n\n"
+               << llvm::format("  %-24s %12s %12s\n", (const char*)"Phase", (const char*)"Wall (ms)", (const char*)"CPU (ms)");
+
+            for (auto& phase : phases_) {
+                os << llvm::format("  %-24s %12.3f %12.3f\n", phase.first.c_str(), phase.second.wallMs(), phase.second.cpuMs());
+            }
+
+            os << llvm::format("  %-24s %12.3f %12.3f\n\n", (const char*)"total", total_.wallMs(), total_.cpuMs());
+
+            for (auto& count : counts_) {
+                os << llvm::format("  %-24s %12llu\n", count.first.c_str(), (unsigned long long)count.second);
+            }
+
+            os << llvm::format("  %-24s %12llu\n\n", (const char*)"peak RSS (KB)", (unsigned long long)peakRssKb_);
+        }
+
+        /**
+         * Prints the report as JSON.
+        */
+        void printJSON(llvm::raw_ostream& os) {
+            stop();
+            llvm::json::OStream json(os, 2);
+
+            json.object([&] {
+                json.attributeObject("phases", [&] {
+                    for (auto& phase : phases_) {
+                        json.attributeObject(jsonKey(phase.first), [&] {
+                            json.attribute("wall_us", phase.second.wallUs());
+                            json.attribute("cpu_us", phase.second.cpuUs());
+                        });
+                    }
+                });
+
+                json.attributeObject("total", [&] {
+                    json.attribute("wall_us", total_.wallUs());
+                    json.attribute("cpu_us", total_.cpuUs());
+                });
+
+                json.attributeObject("counts", [&] {
+                    for (auto& count : counts_) {
+                        json.attribute(jsonKey(count.first), (int64_t)count.second);
+                    }
+                });
+
+                json.attribute("peak_rss_kb", (int64_t)peakRssKb_);
+            });
+
+            os << "\n";
+        }
+
+    private:
+        /**
+         * JSON key of a name, in snake_case: "AST nodes" -> "ast_nodes",
+         * "stack-allocated objects" -> "stack_allocated_objects".
+        */
+        static std::string jsonKey(const std::string& name) {
+            std::string key;
+
+            for (auto c : name) {
+                auto lower = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+                auto isKeyChar = (lower >= 'a' && lower <= 'z') || (lower >= '0' && lower <= '9');
+
+                key += isKeyChar ? lower : '_';
+            }
+
+            return key;
+        }
+
+        static uint64_t peakRssKb() {
+            rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+            return usage.ru_maxrss / 1024;
+#else
+            return usage.ru_maxrss;
+#endif
+        }
+
+        /**
+         * Adds the time to a phase (phases may run several times).
+        */
+        void addPhase(const char* name, const Times& times) {
+            for (auto& phase : phases_) {
+                if (phase.first == name) {
+                    phase.second.wall += times.wall;
+                    phase.second.cpu += times.cpu;
+                    return;
+                }
+            }
+
+            phases_.emplace_back(name, times);
+        }
+
+        Times start_;
+
+        /**
+         * Set by stop()
+        */
+        bool stopped_ = false;
+        Times total_;
+        uint64_t peakRssKb_ = 0;
+
+        /**
+         * Phases, in the order they first ran.
+        */
+        std::vector<std::pair<std::string, Times>> phases_;
+
+        std::vector<std::pair<std::string, uint64_t>> counts_;
+};
+
+#endif
@@ -23,11 +23,10 @@
 #include <assert.h>
 #include <array>
 #include <iostream>
-#include <map>
 #include <memory>
-#include <regex>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // ------------------------------------
@@ -50,9 +49,18 @@
 //   }
 //
 // clang-format off
+#include <algorithm>
+#include <charconv>
+#include <iostream>
+#include <iterator>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
+#include "../SymbolTable.h"
+
 /**
  * Expression type.
  */
@@ -63,35 +71,210 @@ enum class ExpType {
   LIST,
 };
 
+struct Exp;
+
+/**
+ * List entries: a contiguous range of nodes in the AST arena.
+ */
+struct ExpList {
+  const Exp* data_;
+  size_t size_;
+
+  inline const Exp& operator[](size_t i) const;
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  const Exp* begin() const { return data_; }
+  inline const Exp* end() const;
+};
+
 /**
  * Expression.
+ *
+ * Nodes are small trivially-copyable values: strings and symbols are views
+ * into the source buffer, and list entries live in an `ExpArena`. Both the
+ * source and the arena should outlive the AST. A node is either an atom or
+ * a list, so `string` and `list` share storage. Symbols are interned by the
+ * lexer, and compared by their `symbol` ID.
  */
 struct Exp {
   ExpType type;
 
-  int number;
-  std::string string;
-  std::vector<Exp> list;
+  union {
+    int number;
+    Symbol symbol;
+  };
+
+  union {
+    std::string_view string;
+    ExpList list;
+  };
 
   // Numbers:
-  Exp(int number) : type(ExpType::NUMBER), number(number) {}
+  Exp(int number) : type(ExpType::NUMBER), number(number), list{} {}
 
   // Strings, Symbols:
-  Exp(std::string& strVal) {
+  Exp(std::string_view strVal) : number(0), string{} {
     if (strVal[0] == '"') {
       type = ExpType::STRING;
       string = strVal.substr(1, strVal.size() - 2);
     } else {
       type = ExpType::SYMBOL;
       string = strVal;
+      symbol = symbols().intern(strVal);
     }
   }
 
   // Lists:
-  Exp(std::vector<Exp> list) : type(ExpType::LIST), list(list) {}
+  Exp(ExpList list) : type(ExpType::LIST), number(0), list(list) {}
 
 };
 
+const Exp& ExpList::operator[](size_t i) const { return data_[i]; }
+const Exp* ExpList::end() const { return data_ + size_; }
+
+static_assert(std::is_trivially_copyable<Exp>::value &&
+              std::is_trivially_destructible<Exp>::value,
+              "Exp nodes are bump-allocated and never destroyed one by one");
+
+/**
+ * AST arena.
+ *
+ * Nodes are bump-allocated in large blocks, and entries of one list are
+ * always contiguous. While a list is being parsed its entries are collected
+ * on a scratch stack, and copied to the arena once the list is closed, so
+ * reductions never copy subtrees. The whole tree is freed at once by
+ * `clear` (or the arena destructor).
+ */
+class ExpArena {
+ public:
+  ExpArena() = default;
+  ExpArena(ExpArena&&) = default;
+  ExpArena& operator=(ExpArena&&) = default;
+
+  /**
+   * Starts a list: the returned marker records where its entries begin.
+   */
+  Exp beginList() {
+    Exp marker{ExpList{}};
+    marker.number = entries_.size();
+    return marker;
+  }
+
+  /**
+   * Appends an entry to the currently parsed list.
+   */
+  void addEntry(const Exp& exp) { entries_.push_back(exp); }
+
+  /**
+   * Closes the list started with the `marker`, moving its entries to the arena.
+   */
+  Exp endList(const Exp& marker) {
+    size_t first = marker.number;
+    auto list = allocate(entries_.data() + first, entries_.size() - first);
+    entries_.erase(entries_.begin() + first, entries_.end());
+    return Exp(list);
+  }
+
+  /**
+   * Copies `count` nodes to a contiguous range in the arena.
+   */
+  ExpList allocate(const Exp* nodes, size_t count) {
+    if (count == 0) {
+      return ExpList{nullptr, 0};
+    }
+
+    auto data = allocate(count);
+    std::uninitialized_copy(nodes, nodes + count, data);
+
+    return ExpList{data, count};
+  }
+
+  /**
+   * Allocates a contiguous range of `count` nodes, which the caller
+   * should construct in place.
+   */
+  Exp* allocate(size_t count) {
+    if (blocks_.empty() || blockUsed_ + count > blockCapacity_) {
+      blockCapacity_ = std::max(count, BLOCK_SIZE);
+      blocks_.emplace_back(static_cast<Exp*>(::operator new(blockCapacity_ * sizeof(Exp))));
+      blockUsed_ = 0;
+    }
+
+    auto data = blocks_.back().get() + blockUsed_;
+
+    blockUsed_ += count;
+    nodesCount_ += count;
+
+    return data;
+  }
+
+  /**
+   * Takes ownership of the nodes of another arena (e.g. the one a part of
+   * the program was parsed into), so they live as long as this arena.
+   */
+  void adopt(ExpArena&& other) {
+    // The current block stays last, so allocation continues in it.
+    blocks_.insert(blocks_.begin(),
+                   std::make_move_iterator(other.blocks_.begin()),
+                   std::make_move_iterator(other.blocks_.end()));
+    nodesCount_ += other.nodesCount_;
+    other.clear();
+  }
+
+  /**
+   * Number of nodes allocated in the arena.
+   */
+  size_t size() const { return nodesCount_; }
+
+  /**
+   * Frees the whole tree.
+   */
+  void clear() {
+    blocks_.clear();
+    entries_.clear();
+    blockUsed_ = 0;
+    blockCapacity_ = 0;
+    nodesCount_ = 0;
+  }
+
+ private:
+  struct BlockDeleter {
+    void operator()(Exp* block) const { ::operator delete(block); }
+  };
+
+  /**
+   * Default number of nodes per block.
+   */
+  static constexpr size_t BLOCK_SIZE = 4096;
+
+  std::vector<std::unique_ptr<Exp, BlockDeleter>> blocks_;
+  size_t blockUsed_ = 0;
+  size_t blockCapacity_ = 0;
+  size_t nodesCount_ = 0;
+
+  /**
+   * Entries of the lists which are being parsed.
+   */
+  std::vector<Exp> entries_;
+};
+
+/**
+ * Parses a NUMBER token.
+ */
+inline int parseNumber(std::string_view numVal) {
+  int number = 0;
+  auto result = std::from_chars(numVal.data(), numVal.data() + numVal.size(), number);
+
+  if (result.ec != std::errc()) {
+    std::cerr << "Number literal is out of range: " << numVal << "\n";
+    exit(EXIT_FAILURE);
+  }
+
+  return number;
+}
+
 using Value = Exp;  // clang-format on
 
 namespace syntax {
@@ -129,9 +312,13 @@ enum class TokenType {
 // ------------------------------------------------------------------
 // Token.
 
+//
+// Tokens are small fixed-size values: the token text is a view into the
+// source buffer, which should outlive the parsing.
+
 struct Token {
   TokenType type;
-  std::string value;
+  std::string_view value;
 
   int startOffset;
   int endOffset;
@@ -141,18 +328,52 @@ struct Token {
   int endColumn;
 };
 
-using SharedToken = std::shared_ptr<Token>;
-
-typedef TokenType (*LexRuleHandler)(const Tokenizer&, const std::string&);
-
 // ------------------------------------------------------------------
-// Lex rule: [regex, handler]
+// Character classes used by the scanner DFA.
+//
+// The lexical grammar is small enough to be matched by a hand-coded
+// DFA: the first character of a token selects the rule, and the rest of
+// the token is consumed with a class lookup per character. Rule priority
+// follows the order of the rules in the grammar:
+//
+//   '('  ')'  \/\/.*  \/\*[\s\S]*?\*\/  \s+  "[^"]*"  \d+  [\w\-+*=!<>/]+
 
-struct LexRule {
-  std::regex regex;
-  LexRuleHandler handler;
+enum CharClass : unsigned char {
+  CC_SPACE = 1 << 0,   // \s
+  CC_DIGIT = 1 << 1,   // \d
+  CC_SYMBOL = 1 << 2,  // [\w\-+*=!<>/]
 };
 
+struct CharClassTable {
+  unsigned char classes[256];
+};
+
+constexpr CharClassTable makeCharClassTable() {
+  CharClassTable table{};
+
+  for (auto c : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+    table.classes[(unsigned char)c] |= CC_SPACE;
+  }
+
+  for (auto c = '0'; c <= '9'; c++) {
+    table.classes[(unsigned char)c] |= CC_DIGIT | CC_SYMBOL;
+  }
+
+  for (auto c = 'a'; c <= 'z'; c++) {
+    table.classes[(unsigned char)c] |= CC_SYMBOL;
+  }
+
+  for (auto c = 'A'; c <= 'Z'; c++) {
+    table.classes[(unsigned char)c] |= CC_SYMBOL;
+  }
+
+  for (auto c : {'_', '-', '+', '*', '=', '!', '<', '>', '/'}) {
+    table.classes[(unsigned char)c] |= CC_SYMBOL;
+  }
+
+  return table;
+}
+
 // ------------------------------------------------------------------
 // Token.
 
@@ -170,7 +391,7 @@ class Tokenizer {
   /**
    * Initializes a parsing string.
    */
-  void initString(const std::string& str) {
+  void initString(std::string_view str) {
     str_ = str;
 
     // Initialize states.
@@ -188,12 +409,24 @@ class Tokenizer {
     tokenEndLine_ = 0;
     tokenStartColumn_ = 0;
     tokenEndColumn_ = 0;
+
+    implicitBegin_ = ImplicitBegin::NONE;
+  }
+
+  /**
+   * Initializes a parsing string holding a whole program: the sequence
+   * of its top-level expressions is tokenized as if it was wrapped into
+   * `(begin ...)`, without copying the source.
+   */
+  void initProgram(std::string_view str) {
+    initString(str);
+    implicitBegin_ = ImplicitBegin::OPEN;
   }
 
   /**
    * Whether there are still tokens in the stream.
    */
-  inline bool hasMoreTokens() { return cursor_ <= str_.length(); }
+  inline bool hasMoreTokens() { return cursor_ <= (int)str_.length(); }
 
   /**
    * Returns current tokenizing state.
@@ -222,59 +455,64 @@ class Tokenizer {
   /**
    * Returns next token.
    */
-  SharedToken getNextToken() {
+  Token getNextToken() {
     if (!hasMoreTokens()) {
       yytext = __EOF;
       return toToken(TokenType::__EOF);
     }
 
-    auto strSlice = str_.substr(cursor_);
+    switch (implicitBegin_) {
+      case ImplicitBegin::OPEN:
+        implicitBegin_ = ImplicitBegin::KEYWORD;
+        return implicitToken_(TokenType::TOKEN_TYPE_7, "(");
 
-    auto lexRulesForState = lexRulesByStartConditions_.at(getCurrentState());
+      case ImplicitBegin::KEYWORD:
+        implicitBegin_ = ImplicitBegin::BODY;
+        return implicitToken_(TokenType::SYMBOL, "begin");
 
-    for (const auto& ruleIndex : lexRulesForState) {
-      auto rule = lexRules_[ruleIndex];
-      std::smatch sm;
+      default:
+        break;
+    }
 
-      if (std::regex_search(strSlice, sm, rule.regex)) {
-        yytext = sm[0];
+    for (;;) {
+      if (isEOF()) {
+        if (implicitBegin_ == ImplicitBegin::BODY) {
+          implicitBegin_ = ImplicitBegin::NONE;
+          return implicitToken_(TokenType::TOKEN_TYPE_8, ")");
+        }
 
-        captureLocations_(yytext);
-        cursor_ += yytext.length();
+        cursor_++;
+        yytext = __EOF;
+        return toToken(TokenType::__EOF);
+      }
 
-        // Manual handling of EOF token (the end of string). Return it
-        // as `EOF` symbol.
-        if (yytext.length() == 0) {
-          cursor_++;
-        }
+      auto start = cursor_;
+      TokenType tokenType;
 
-        auto tokenType = rule.handler(*this, yytext);
+      if (!scan_(tokenType)) {
+        throwUnexpectedToken(str_.substr(cursor_, 1), currentLine_,
+                             currentColumn_);
+      }
 
-        if (tokenType == TokenType::__EMPTY) {
-          return getNextToken();
-        }
+      captureLocations_(start);
 
-        return toToken(tokenType);
+      // Skipped tokens (whitespace, comments).
+      if (tokenType == TokenType::__EMPTY) {
+        continue;
       }
-    }
 
-    if (isEOF()) {
-      cursor_++;
-      yytext = __EOF;
-      return toToken(TokenType::__EOF);
+      yytext = str_.substr(start, cursor_ - start);
+      return toToken(tokenType);
     }
-
-    throwUnexpectedToken(std::string(1, strSlice[0]), currentLine_,
-                         currentColumn_);
   }
 
   /**
    * Whether the cursor is at the EOF.
    */
-  inline bool isEOF() { return cursor_ == str_.length(); }
+  inline bool isEOF() { return cursor_ == (int)str_.length(); }
 
-  SharedToken toToken(TokenType tokenType) {
-    return std::shared_ptr<Token>(new Token{
+  Token toToken(TokenType tokenType) {
+    return Token{
         .type = tokenType,
         .value = yytext,
         .startOffset = tokenStartOffset_,
@@ -283,7 +521,7 @@ class Tokenizer {
         .endLine = tokenEndLine_,
         .startColumn = tokenStartColumn_,
         .endColumn = tokenEndColumn_,
-    });
+    };
   }
 
   /**
@@ -291,9 +529,9 @@ class Tokenizer {
    * line from the source, pointing with the ^ marker to the bad token.
    * In addition, shows `line:column` location.
    */
-  [[noreturn]] void throwUnexpectedToken(const std::string& symbol, int line,
+  [[noreturn]] void throwUnexpectedToken(std::string_view symbol, int line,
                                          int column) {
-    std::stringstream ss{str_};
+    std::stringstream ss{std::string(str_)};
     std::string lineStr;
     int currentLine = 1;
 
@@ -312,38 +550,151 @@ class Tokenizer {
 
     std::cerr << errMsg.str();
     //throw new std::runtime_error(errMsg.str().c_str());
+    exit(EXIT_FAILURE);
   }
 
   /**
    * Matched text.
    */
-  std::string yytext;
+  std::string_view yytext;
 
  private:
   /**
-   * Captures token locations.
+   * Stages of the implicit top-level `(begin ...)` of a program.
+   */
+  enum class ImplicitBegin {
+    NONE,
+    OPEN,
+    KEYWORD,
+    BODY,
+  };
+
+  /**
+   * Returns a token which is not present in the source. It has an
+   * empty location at the cursor, so errors point to the real source.
    */
-  void captureLocations_(const std::string& matched) {
-    auto len = matched.length();
+  Token implicitToken_(TokenType tokenType, std::string_view text) {
+    tokenStartOffset_ = tokenEndOffset_ = cursor_;
+    tokenStartLine_ = tokenEndLine_ = currentLine_;
+    tokenStartColumn_ = tokenEndColumn_ = cursor_ - currentLineBeginOffset_;
+
+    yytext = text;
+    return toToken(tokenType);
+  }
+
+  /**
+   * Runs the scanner DFA from the cursor, advancing it past the matched
+   * token. Returns false if no lexical rule matches at the cursor.
+   */
+  bool scan_(TokenType& tokenType) {
+    auto s = str_.data();
+    int length = str_.length();
+
+    switch (s[cursor_]) {
+      case '(':
+        cursor_++;
+        tokenType = TokenType::TOKEN_TYPE_7;
+        return true;
+
+      case ')':
+        cursor_++;
+        tokenType = TokenType::TOKEN_TYPE_8;
+        return true;
+
+      case '/':
+        // Line comment: \/\/.*
+        if (cursor_ + 1 < length && s[cursor_ + 1] == '/') {
+          cursor_ += 2;
+          while (cursor_ < length && s[cursor_] != '\n' && s[cursor_] != '\r') {
+            cursor_++;
+          }
+          tokenType = TokenType::__EMPTY;
+          return true;
+        }
+
+        // Block comment: \/\*[\s\S]*?\*\/
+        // An unterminated comment falls through to the symbol rule.
+        if (cursor_ + 1 < length && s[cursor_ + 1] == '*') {
+          auto end = str_.find("*/", cursor_ + 2);
+          if (end != std::string_view::npos) {
+            cursor_ = end + 2;
+            tokenType = TokenType::__EMPTY;
+            return true;
+          }
+        }
+        break;
+
+      case '"': {
+        // String: "[^"]*"
+        auto end = str_.find('"', cursor_ + 1);
+        if (end == std::string_view::npos) {
+          return false;
+        }
+        cursor_ = end + 1;
+        tokenType = TokenType::STRING;
+        return true;
+      }
+    }
 
+    auto cc = charClasses_.classes[(unsigned char)s[cursor_]];
+
+    // Whitespace: \s+
+    if (cc & CC_SPACE) {
+      tokenType = TokenType::__EMPTY;
+      return consume_(CC_SPACE);
+    }
+
+    // Number: \d+
+    if (cc & CC_DIGIT) {
+      tokenType = TokenType::NUMBER;
+      return consume_(CC_DIGIT);
+    }
+
+    // Symbol: [\w\-+*=!<>/]+
+    if (cc & CC_SYMBOL) {
+      tokenType = TokenType::SYMBOL;
+      return consume_(CC_SYMBOL);
+    }
+
+    return false;
+  }
+
+  /**
+   * Advances the cursor while characters belong to the class.
+   */
+  inline bool consume_(unsigned char charClass) {
+    auto s = str_.data();
+    int length = str_.length();
+
+    do {
+      cursor_++;
+    } while (cursor_ < length &&
+             (charClasses_.classes[(unsigned char)s[cursor_]] & charClass));
+
+    return true;
+  }
+
+  /**
+   * Captures locations of the token spanning from `start` to the cursor.
+   */
+  void captureLocations_(int start) {
     // Absolute offsets.
-    tokenStartOffset_ = cursor_;
+    tokenStartOffset_ = start;
 
     // Line-based locations, start.
     tokenStartLine_ = currentLine_;
     tokenStartColumn_ = tokenStartOffset_ - currentLineBeginOffset_;
 
     // Extract `\n` in the matched token.
-    std::stringstream ss{matched};
-    std::string lineStr;
-    std::getline(ss, lineStr, '\n');
-    while (ss.tellg() > 0 && ss.tellg() <= len) {
-      currentLine_++;
-      currentLineBeginOffset_ = tokenStartOffset_ + ss.tellg();
-      std::getline(ss, lineStr, '\n');
+    auto s = str_.data();
+    for (auto i = start; i < cursor_; i++) {
+      if (s[i] == '\n') {
+        currentLine_++;
+        currentLineBeginOffset_ = i + 1;
+      }
     }
 
-    tokenEndOffset_ = cursor_ + len;
+    tokenEndOffset_ = cursor_;
 
     // Line-based locations, end.
     tokenEndLine_ = currentLine_;
@@ -352,23 +703,19 @@ class Tokenizer {
   }
 
   /**
-   * Lexical rules.
+   * Scanner character classes.
    */
-  // clang-format off
-  static constexpr size_t LEX_RULES_COUNT = 8;
-  static std::array<LexRule, LEX_RULES_COUNT> lexRules_;
-  static std::map<TokenizerState, std::vector<size_t>> lexRulesByStartConditions_;
-  // clang-format on
+  static constexpr CharClassTable charClasses_ = makeCharClassTable();
 
   /**
    * Special EOF token.
    */
-  static std::string __EOF;
+  static constexpr std::string_view __EOF{"$"};
 
   /**
-   * Tokenizing string.
+   * Tokenizing string (a view into the caller's buffer).
    */
-  std::string str_;
+  std::string_view str_;
 
   /**
    * Cursor for current symbol.
@@ -396,63 +743,12 @@ class Tokenizer {
   int tokenEndLine_;
   int tokenStartColumn_;
   int tokenEndColumn_;
-};
 
-// ------------------------------------------------------------------
-// Lexical rule handlers.
-
-std::string Tokenizer::__EOF("$");
-
-// clang-format off
-inline TokenType _lexRule1(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::TOKEN_TYPE_7;
-}
-
-inline TokenType _lexRule2(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::TOKEN_TYPE_8;
-}
-
-inline TokenType _lexRule3(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::__EMPTY;
-}
-
-inline TokenType _lexRule4(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::__EMPTY;
-}
-
-inline TokenType _lexRule5(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::__EMPTY;
-}
-
-inline TokenType _lexRule6(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::STRING;
-}
-
-inline TokenType _lexRule7(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::NUMBER;
-}
-
-inline TokenType _lexRule8(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::SYMBOL;
-}
-// clang-format on
-
-// ------------------------------------------------------------------
-// Lexical rules.
-
-// clang-format off
-std::array<LexRule, Tokenizer::LEX_RULES_COUNT> Tokenizer::lexRules_ = {{
-  {std::regex(R"(^\()"), &_lexRule1},
-  {std::regex(R"(^\))"), &_lexRule2},
-  {std::regex(R"(^\/\/.*)"), &_lexRule3},
-  {std::regex(R"(^\/\*[\s\S]*?\*\/)"), &_lexRule4},
-  {std::regex(R"(^\s+)"), &_lexRule5},
-  {std::regex(R"(^"[^\"]*")"), &_lexRule6},
-  {std::regex(R"(^\d+)"), &_lexRule7},
-  {std::regex(R"(^[\w\-+*=!<>/]+)"), &_lexRule8}
-}};
-std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditions_ =  {{TokenizerState::INITIAL, {0, 1, 2, 3, 4, 5, 6, 7}}};
-// clang-format on
+  /**
+   * Implicit `(begin ...)` stage, if a whole program is tokenized.
+   */
+  ImplicitBegin implicitBegin_;
+};
 
 #endif
 // clang-format on
@@ -469,9 +765,10 @@ std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditio
 #define PUSH_TR() parser.tokensStack.push_back(__)
 
 /**
- * Parsing table type.
+ * Parsing table type. Empty entries are errors.
  */
 enum class TE {
+  Error,
   Accept,
   Shift,
   Reduce,
@@ -494,6 +791,18 @@ using yyparse = EvaParser;
 
 typedef void (*ProductionHandler)(yyparse&);
 
+// clang-format off
+void _handler1(yyparse& parser);
+void _handler2(yyparse& parser);
+void _handler3(yyparse& parser);
+void _handler4(yyparse& parser);
+void _handler5(yyparse& parser);
+void _handler6(yyparse& parser);
+void _handler7(yyparse& parser);
+void _handler8(yyparse& parser);
+void _handler9(yyparse& parser);
+// clang-format on
+
 /**
  * Encoded production.
  *
@@ -506,10 +815,6 @@ struct Production {
   ProductionHandler handler;
 };
 
-// Key: Encoded symbol (terminal or non-terminal) index
-// Value: TableEntry
-using Row = std::map<int, TableEntry>;
-
 /**
  * Parser class.
  */
@@ -525,7 +830,7 @@ class EvaParser {
   /**
    * Token values stack.
    */
-  std::vector<std::string> tokensStack;
+  std::vector<std::string_view> tokensStack;
 
   /**
    * Parsing states stack.
@@ -537,6 +842,12 @@ class EvaParser {
    */
   Tokenizer tokenizer;
 
+  /**
+   * AST storage. Nodes of the last parsed tree live here until
+   * the next parse (or `arena.clear()`).
+   */
+  ExpArena arena;
+
   /**
    * Previous state to calculate the next one.
    */
@@ -545,13 +856,32 @@ class EvaParser {
   /**
    * Parses a string.
    */
-  Value parse(const std::string& str) {
+  Value parse(std::string_view str) {
+    // Initialize the tokenizer and the string.
+    tokenizer.initString(str);
+    return parse_();
+  }
+
+  /**
+   * Parses a whole program: a sequence of top-level expressions, which
+   * are returned as one `(begin ...)` expression.
+   */
+  Value parseProgram(std::string_view str) {
+    tokenizer.initProgram(str);
+    return parse_();
+  }
+
+ private:
+  /**
+   * Runs the parser on the initialized tokenizer.
+   */
+  Value parse_() {
     // clang-format off
     
     // clang-format on
 
-    // Initialize the tokenizer and the string.
-    tokenizer.initString(str);
+    // Free the previous tree.
+    arena.clear();
 
     // Initialize the stacks.
     valuesStack.clear();
@@ -567,18 +897,18 @@ class EvaParser {
     // Main parsing loop.
     for (;;) {
       auto state = statesStack.back();
-      auto column = (int)token->type;
+      auto column = (int)token.type;
 
-      if (table_[state].count(column) == 0) {
+      auto entry = table_[state][column];
+
+      if (entry.type == TE::Error) {
         throwUnexpectedToken(token);
       }
 
-      auto entry = table_[state].at(column);
-
       // Shift a token, go to state.
       if (entry.type == TE::Shift) {
         // Push token.
-        tokensStack.push_back(token->value);
+        tokensStack.push_back(token.value);
 
         // Push next state number: "s5" -> 5
         statesStack.push_back(entry.value);
@@ -590,9 +920,9 @@ class EvaParser {
       // Reduce by production.
       else if (entry.type == TE::Reduce) {
         auto productionNumber = entry.value;
-        auto production = productions_[productionNumber];
+        auto& production = productions_[productionNumber];
 
-        tokenizer.yytext = shiftedToken->value;
+        tokenizer.yytext = shiftedToken.value;
 
         auto rhsLength = production.rhsLength;
         while (rhsLength > 0) {
@@ -606,7 +936,7 @@ class EvaParser {
         auto previousState = statesStack.back();
 
         auto symbolToReduceWith = production.opcode;
-        auto nextStateEntry = table_[previousState].at(symbolToReduceWith);
+        auto nextStateEntry = table_[previousState][symbolToReduceWith];
         assert(nextStateEntry.type == TE::Transit);
 
         statesStack.push_back(nextStateEntry.value);
@@ -638,26 +968,27 @@ class EvaParser {
     }
   }
 
- private:
   /**
    * Throws parser error on unexpected token.
    */
-  [[noreturn]] void throwUnexpectedToken(SharedToken token) {
-    if (token->type == TokenType::__EOF && !tokenizer.hasMoreTokens()) {
+  [[noreturn]] void throwUnexpectedToken(const Token& token) {
+    if (token.type == TokenType::__EOF && !tokenizer.hasMoreTokens()) {
       std::string errMsg = "Unexpected end of input.\n";
       std::cerr << errMsg;
       //throw std::runtime_error(errMsg.c_str());
     }
-    tokenizer.throwUnexpectedToken(token->value, token->startLine,
-                                   token->startColumn);
+    tokenizer.throwUnexpectedToken(token.value, token.startLine,
+                                   token.startColumn);
   }
 
   // clang-format off
   static constexpr size_t PRODUCTIONS_COUNT = 9;
-  static std::array<Production, PRODUCTIONS_COUNT> productions_;
+  static const std::array<Production, PRODUCTIONS_COUNT> productions_;
 
+  // Rows: states, columns: encoded symbols (non-terminals, then terminals).
   static constexpr size_t ROWS_COUNT = 11;
-  static std::array<Row, ROWS_COUNT> table_;
+  static constexpr size_t COLUMNS_COUNT = 10;
+  static const TableEntry table_[ROWS_COUNT][COLUMNS_COUNT];
   // clang-format on
 };
 
@@ -702,7 +1033,7 @@ void _handler4(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(std::stoi(_1)) ;
+auto __ = Exp(parseNumber(_1)) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -737,7 +1068,7 @@ parser.tokensStack.pop_back();
 auto _2 = POP_V();
 parser.tokensStack.pop_back();
 
-auto __ = _2 ;
+auto __ = parser.arena.endList(_2) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -748,7 +1079,7 @@ void _handler8(yyparse& parser) {
 // Semantic action prologue.
 
 
-auto __ = Exp(std::vector<Exp>{}) ;
+auto __ = parser.arena.beginList() ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -760,7 +1091,7 @@ void _handler9(yyparse& parser) {
 auto _2 = POP_V();
 auto _1 = POP_V();
 
-_1.list.push_back(_2); auto __ = _1 ;
+parser.arena.addEntry(_2); auto __ = _1 ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -769,7 +1100,7 @@ PUSH_VR();
 // clang-format on
 
 // clang-format off
-std::array<Production, yyparse::PRODUCTIONS_COUNT> yyparse::productions_ = {{{-1, 1, &_handler1},
+constexpr std::array<Production, yyparse::PRODUCTIONS_COUNT> yyparse::productions_ = {{{-1, 1, &_handler1},
 {0, 1, &_handler2},
 {0, 1, &_handler3},
 {1, 1, &_handler4},
@@ -784,18 +1115,18 @@ std::array<Production, yyparse::PRODUCTIONS_COUNT> yyparse::productions_ = {{{-1
 // Parsing table.
 
 // clang-format off
-std::array<Row, yyparse::ROWS_COUNT> yyparse::table_ = {
-    Row {{0, {TE::Transit, 1}}, {1, {TE::Transit, 2}}, {2, {TE::Transit, 3}}, {4, {TE::Shift, 4}}, {5, {TE::Shift, 5}}, {6, {TE::Shift, 6}}, {7, {TE::Shift, 7}}},
-    Row {{9, {TE::Accept, 0}}},
-    Row {{4, {TE::Reduce, 1}}, {5, {TE::Reduce, 1}}, {6, {TE::Reduce, 1}}, {7, {TE::Reduce, 1}}, {8, {TE::Reduce, 1}}, {9, {TE::Reduce, 1}}},
-    Row {{4, {TE::Reduce, 2}}, {5, {TE::Reduce, 2}}, {6, {TE::Reduce, 2}}, {7, {TE::Reduce, 2}}, {8, {TE::Reduce, 2}}, {9, {TE::Reduce, 2}}},
-    Row {{4, {TE::Reduce, 3}}, {5, {TE::Reduce, 3}}, {6, {TE::Reduce, 3}}, {7, {TE::Reduce, 3}}, {8, {TE::Reduce, 3}}, {9, {TE::Reduce, 3}}},
-    Row {{4, {TE::Reduce, 4}}, {5, {TE::Reduce, 4}}, {6, {TE::Reduce, 4}}, {7, {TE::Reduce, 4}}, {8, {TE::Reduce, 4}}, {9, {TE::Reduce, 4}}},
-    Row {{4, {TE::Reduce, 5}}, {5, {TE::Reduce, 5}}, {6, {TE::Reduce, 5}}, {7, {TE::Reduce, 5}}, {8, {TE::Reduce, 5}}, {9, {TE::Reduce, 5}}},
-    Row {{3, {TE::Transit, 8}}, {4, {TE::Reduce, 7}}, {5, {TE::Reduce, 7}}, {6, {TE::Reduce, 7}}, {7, {TE::Reduce, 7}}, {8, {TE::Reduce, 7}}},
-    Row {{0, {TE::Transit, 10}}, {1, {TE::Transit, 2}}, {2, {TE::Transit, 3}}, {4, {TE::Shift, 4}}, {5, {TE::Shift, 5}}, {6, {TE::Shift, 6}}, {7, {TE::Shift, 7}}, {8, {TE::Shift, 9}}},
-    Row {{4, {TE::Reduce, 6}}, {5, {TE::Reduce, 6}}, {6, {TE::Reduce, 6}}, {7, {TE::Reduce, 6}}, {8, {TE::Reduce, 6}}, {9, {TE::Reduce, 6}}},
-    Row {{4, {TE::Reduce, 8}}, {5, {TE::Reduce, 8}}, {6, {TE::Reduce, 8}}, {7, {TE::Reduce, 8}}, {8, {TE::Reduce, 8}}}
+constexpr TableEntry yyparse::table_[yyparse::ROWS_COUNT][yyparse::COLUMNS_COUNT] = {
+    {{TE::Transit, 1}, {TE::Transit, 2}, {TE::Transit, 3}, {}, {TE::Shift, 4}, {TE::Shift, 5}, {TE::Shift, 6}, {TE::Shift, 7}, {}, {}},
+    {{}, {}, {}, {}, {}, {}, {}, {}, {}, {TE::Accept, 0}},
+    {{}, {}, {}, {}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}},
+    {{}, {}, {}, {}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}},
+    {{}, {}, {}, {}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}},
+    {{}, {}, {}, {}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}},
+    {{}, {}, {}, {}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}},
+    {{}, {}, {}, {TE::Transit, 8}, {TE::Reduce, 7}, {TE::Reduce, 7}, {TE::Reduce, 7}, {TE::Reduce, 7}, {TE::Reduce, 7}, {}},
+    {{TE::Transit, 10}, {TE::Transit, 2}, {TE::Transit, 3}, {}, {TE::Shift, 4}, {TE::Shift, 5}, {TE::Shift, 6}, {TE::Shift, 7}, {TE::Shift, 9}, {}},
+    {{}, {}, {}, {}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}},
+    {{}, {}, {}, {}, {TE::Reduce, 8}, {TE::Reduce, 8}, {TE::Reduce, 8}, {TE::Reduce, 8}, {TE::Reduce, 8}, {}}
 };
 // clang-format on
 
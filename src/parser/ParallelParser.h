@@ -0,0 +1,221 @@
+/**
+ * Parallel front end: parses top-level forms of a program on a thread pool
+*/
+
+#ifndef ParallelParser_h
+#define ParallelParser_h
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "EvaParser.h"
+
+/**
+ * A program is a sequence of independent top-level expressions, so it is
+ * split into chunks at top-level boundaries, the chunks are parsed by
+ * worker parsers, and their expressions are stitched into one
+ * `(begin ...)` in source order.
+ *
+ * The split is done by a prescan, which follows the lexical grammar of
+ * the tokenizer. Any chunk it produces is balanced and lexically valid,
+ * so it always parses. Programs which would fail to parse (unbalanced
+ * parens, bad characters, number literals which may not fit) are parsed
+ * serially instead, so diagnostics are exactly the ones of a serial parse.
+*/
+class ParallelParser {
+    public:
+        ParallelParser(syntax::EvaParser& parser, unsigned threads = std::thread::hardware_concurrency())
+            : parser_(parser), threads_(std::max(threads, 1u)) {}
+
+        /**
+         * Parses a whole program. The nodes live in the arena of the parser.
+        */
+        Exp parseProgram(std::string_view program) {
+            std::vector<std::string_view> chunks;
+
+            if (threads_ == 1 || program.size() < 2 * MIN_CHUNK_SIZE ||
+                !split(program, chunks) || chunks.size() < 2) {
+                return parser_.parseProgram(program);
+            }
+
+            // 1. Parse the chunks on the pool
+            std::vector<Exp> results(chunks.size(), Exp(ExpList{}));
+            std::vector<ExpArena> arenas(chunks.size());
+            std::atomic<size_t> nextChunk{0};
+
+            auto worker = [&]() {
+                syntax::EvaParser chunkParser;
+
+                for (auto i = nextChunk++; i < chunks.size(); i = nextChunk++) {
+                    results[i] = chunkParser.parseProgram(chunks[i]);
+                    arenas[i] = std::move(chunkParser.arena);
+                }
+            };
+
+            std::vector<std::thread> pool;
+            auto poolSize = std::min<size_t>(threads_, chunks.size());
+
+            for (size_t i = 0; i < poolSize; i++) {
+                pool.emplace_back(worker);
+            }
+
+            for (auto& thread : pool) {
+                thread.join();
+            }
+
+            // 2. Stitch: (begin <forms of chunk 0> <forms of chunk 1> ...)
+            parser_.arena.clear();
+
+            std::vector<Exp> forms{results[0].list[0]};
+
+            for (size_t i = 0; i < chunks.size(); i++) {
+                auto& chunk = results[i].list;
+                forms.insert(forms.end(), chunk.begin() + 1, chunk.end());
+                parser_.arena.adopt(std::move(arenas[i]));
+            }
+
+            return Exp(parser_.arena.allocate(forms.data(), forms.size()));
+        }
+
+    private:
+        /**
+         * Splits the program into chunks at top-level boundaries.
+         * Returns false if the program has to be parsed serially.
+        */
+        bool split(std::string_view program, std::vector<std::string_view>& chunks) {
+            auto s = program.data();
+            size_t length = program.size();
+
+            auto chunkSize = std::max(MIN_CHUNK_SIZE, length / (threads_ * CHUNKS_PER_THREAD));
+            size_t chunkStart = 0;
+            size_t depth = 0;
+            size_t i = 0;
+
+            // Cuts a chunk after a top-level expression ending at the cursor
+            auto boundary = [&]() {
+                if (depth == 0 && i - chunkStart >= chunkSize) {
+                    chunks.push_back(program.substr(chunkStart, i - chunkStart));
+                    chunkStart = i;
+                }
+            };
+
+            while (i < length) {
+                switch (s[i]) {
+                    case '(':
+                        depth++;
+                        i++;
+                        continue;
+
+                    case ')':
+                        if (depth == 0) {
+                            return false;
+                        }
+                        depth--;
+                        i++;
+                        boundary();
+                        continue;
+
+                    case '"': {
+                        auto end = program.find('"', i + 1);
+                        if (end == std::string_view::npos) {
+                            return false;
+                        }
+                        i = end + 1;
+                        boundary();
+                        continue;
+                    }
+
+                    case '/':
+                        // Comments, otherwise '/' starts a symbol
+                        if (i + 1 < length && s[i + 1] == '/') {
+                            while (i < length && s[i] != '\n' && s[i] != '\r') {
+                                i++;
+                            }
+                            continue;
+                        }
+
+                        if (i + 1 < length && s[i + 1] == '*') {
+                            auto end = program.find("*/", i + 2);
+                            if (end != std::string_view::npos) {
+                                i = end + 2;
+                                continue;
+                            }
+                        }
+                        break;
+                }
+
+                auto cc = charClasses_.classes[(unsigned char)s[i]];
+
+                if (cc & syntax::CC_SPACE) {
+                    i++;
+                }
+
+                else if (cc & syntax::CC_DIGIT) {
+                    auto start = i;
+                    while (i < length && (charClasses_.classes[(unsigned char)s[i]] & syntax::CC_DIGIT)) {
+                        i++;
+                    }
+
+                    // The parser reports literals out of int range
+                    if (i - start > MAX_SAFE_DIGITS) {
+                        return false;
+                    }
+                    boundary();
+                }
+
+                else if (cc & syntax::CC_SYMBOL) {
+                    while (i < length && (charClasses_.classes[(unsigned char)s[i]] & syntax::CC_SYMBOL)) {
+                        i++;
+                    }
+                    boundary();
+                }
+
+                else {
+                    return false;
+                }
+            }
+
+            if (depth != 0) {
+                return false;
+            }
+
+            chunks.push_back(program.substr(chunkStart));
+            return true;
+        }
+
+        /**
+         * Chunks smaller than this are not worth a parser.
+        */
+        static constexpr size_t MIN_CHUNK_SIZE = 64 * 1024;
+
+        /**
+         * More chunks than threads, to balance the load.
+        */
+        static constexpr size_t CHUNKS_PER_THREAD = 4;
+
+        /**
+         * Number literals with up to this many digits always fit an int.
+        */
+        static constexpr size_t MAX_SAFE_DIGITS = 9;
+
+        /**
+         * Scanner character classes (same as the tokenizer's).
+        */
+        static constexpr syntax::CharClassTable charClasses_ = syntax::makeCharClassTable();
+
+        /**
+         * Parser which owns the resulting AST.
+        */
+        syntax::EvaParser& parser_;
+
+        /**
+         * Number of worker threads.
+        */
+        unsigned threads_;
+};
+
+#endif
@@ -0,0 +1,666 @@
+/**
+ * Eva runtime: precise, generational garbage collector
+ *
+ * Young objects are bump-allocated in the nursery. When it is full, a
+ * minor collection copies its live objects to the old generation (all
+ * survivors are promoted), and the nursery is empty again. Its roots
+ * are the frames of Eva functions, found through the stack maps LLVM
+ * emits for each call (statepoint), and the old objects which were
+ * written since the last collection (the remembered set, kept by the
+ * write barrier).
+ *
+ * Old objects are allocated individually and do not move. When the old
+ * generation has doubled since the last major collection, it is marked
+ * from the roots and swept.
+ *
+ * Each object is preceded by a header word: its type map, or once it
+ * is copied out of the nursery, its new address. The low bits are flags.
+ *
+ * Frames are walked through frame pointers: Eva code is compiled with
+ * them, and this file should be too (-fno-omit-frame-pointer).
+ *
+ * Environment:
+ *   EVA_GC_NURSERY_SIZE  Nursery size in bytes (default: 4 MiB)
+ *   EVA_GC_STATS         Print the collection statistics at exit
+*/
+
+#include "EvaGC.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <elf.h>
+#include <link.h>
+
+char* eva_gc_nursery_top = nullptr;
+char* eva_gc_nursery_limit = nullptr;
+
+namespace {
+
+/**
+ * Header flags
+*/
+constexpr uintptr_t FORWARDED = 1;   // Nursery: copied, the header is the new address
+constexpr uintptr_t REMEMBERED = 2;  // Old: in the remembered set
+constexpr uintptr_t MARKED = 4;      // Old: reached by the major collection
+constexpr uintptr_t FLAGS = 7;
+
+struct Header {
+    uintptr_t word;
+};
+
+/**
+ * Stack map location (LLVM stack map format, version 3)
+*/
+struct Location {
+    uint8_t kind;
+    uint8_t reserved;
+    uint16_t size;
+    uint16_t regNum;
+    uint16_t reserved2;
+    int32_t offset;
+};
+
+static_assert(sizeof(Location) == 12, "Stack map locations are 12 bytes");
+
+enum LocationKind : uint8_t {
+    REGISTER = 1,
+    DIRECT = 2,
+    INDIRECT = 3,
+    CONSTANT = 4,
+    CONSTANT_INDEX = 5,
+};
+
+/**
+ * x86-64 DWARF register numbers
+*/
+constexpr uint16_t DWARF_RBP = 6;
+constexpr uint16_t DWARF_RSP = 7;
+
+/**
+ * Locations of a statepoint: calling convention, flags, number of
+ * deopt values, the deopt values, then (base, derived) pairs of the
+ * live objects.
+*/
+struct SafePoint {
+    const Location* locations;
+    uint16_t locationCount;
+};
+
+/**
+ * Frame slots of a live object: its base, and a pointer derived from
+ * it (into a field, or the base itself).
+*/
+struct Root {
+    uintptr_t* base;
+    uintptr_t* derived;
+};
+
+constexpr size_t DEFAULT_NURSERY_SIZE = 4 << 20;
+constexpr size_t MIN_MAJOR_THRESHOLD = 16 << 20;
+
+/**
+ * Nursery bounds (the write barrier's fast path). Its allocation
+ * pointer is eva_gc_nursery_top, which points past the next header.
+*/
+char* nurseryBegin = nullptr;
+char* nurseryEnd = nullptr;
+
+size_t alignSize(size_t size) {
+    return (size + 7) & ~size_t(7);
+}
+
+size_t objectSize(const EvaTypeMap* typeMap) {
+    return sizeof(Header) + alignSize(typeMap->size);
+}
+
+const EvaTypeMap* typeMapOf(const Header* header) {
+    return reinterpret_cast<const EvaTypeMap*>(header->word & ~FLAGS);
+}
+
+const uint64_t* pointerOffsets(const EvaTypeMap* typeMap) {
+    return reinterpret_cast<const uint64_t*>(typeMap + 1);
+}
+
+template <typename T>
+T read(const uint8_t* p) {
+    T value;
+    memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+const uint8_t* align8(const uint8_t* p) {
+    return reinterpret_cast<const uint8_t*>((reinterpret_cast<uintptr_t>(p) + 7) & ~uintptr_t(7));
+}
+
+/**
+ * Start of the free space of the nursery
+*/
+char* nurseryFree() {
+    return eva_gc_nursery_top - sizeof(Header);
+}
+
+/**
+ * Allocates an object of `size` bytes (with its header) in the nursery,
+ * as the fast path inlined by the compiler does; nullptr if it is full.
+*/
+void* bumpAllocate(const EvaTypeMap* typeMap, size_t size) {
+    if (size > static_cast<size_t>(eva_gc_nursery_limit - eva_gc_nursery_top)) {
+        return nullptr;
+    }
+
+    auto object = eva_gc_nursery_top;
+    eva_gc_nursery_top += size;
+
+    auto header = reinterpret_cast<Header*>(object) - 1;
+    header->word = reinterpret_cast<uintptr_t>(typeMap);
+
+    return object;
+}
+
+[[noreturn]] void die(const char* message) {
+    fprintf(stderr, "Eva GC: %s\n", message);
+    abort();
+}
+
+class Heap;
+Heap& heap();
+
+class Heap {
+    public:
+        /**
+         * Allocates when the nursery is full (or not created yet).
+         * `frame` is the frame of eva_gc_alloc, called by Eva code.
+        */
+        void* allocateSlow(const EvaTypeMap* typeMap, void** frame) {
+            if (nursery_ == nullptr) {
+                init();
+            }
+
+            auto size = objectSize(typeMap);
+
+            // Large objects would empty the nursery too often
+            if (size > nurserySize_ / 4) {
+                auto header = allocateOld(size);
+                memset(header, 0, size);
+                header->word = reinterpret_cast<uintptr_t>(typeMap);
+                return header + 1;
+            }
+
+            if (auto object = bumpAllocate(typeMap, size)) {
+                return object;
+            }
+
+            collect(frame);
+
+            return bumpAllocate(typeMap, size);
+        }
+
+        void remember(Header* header) {
+            header->word |= REMEMBERED;
+            remembered_.push_back(header);
+        }
+
+        void registerStackMap(const uint8_t* section, uint64_t size) {
+            std::lock_guard<std::mutex> lock(pendingMutex_);
+            pendingStackMaps_.emplace_back(section, size);
+        }
+
+        void printStats() const {
+            fprintf(stderr,
+                "Eva GC: %zu minor, %zu major collections; %zu bytes allocated, %zu promoted, %zu old\n",
+                minorCollections_, majorCollections_, allocatedBytes_ + (nurseryFree() - nursery_),
+                promotedBytes_, oldBytes_);
+        }
+
+    private:
+        void init() {
+            nurserySize_ = DEFAULT_NURSERY_SIZE;
+
+            if (auto size = getenv("EVA_GC_NURSERY_SIZE")) {
+                nurserySize_ = std::max<size_t>(alignSize(strtoull(size, nullptr, 10)), 4096);
+            }
+
+            nursery_ = static_cast<char*>(calloc(nurserySize_, 1));
+
+            if (nursery_ == nullptr) {
+                die("Cannot allocate the nursery.");
+            }
+
+            nurseryBegin = nursery_;
+            nurseryEnd = nursery_ + nurserySize_;
+
+            eva_gc_nursery_top = nurseryBegin + sizeof(Header);
+            eva_gc_nursery_limit = nurseryEnd + sizeof(Header);
+
+            if (getenv("EVA_GC_STATS") != nullptr) {
+                atexit([] { heap().printStats(); });
+            }
+        }
+
+        void collect(void** frame) {
+            roots_.clear();
+            findRoots(frame);
+
+            minorCollection();
+
+            if (oldBytes_ >= majorThreshold_) {
+                majorCollection();
+            }
+        }
+
+        /**
+         * Walks the frames of Eva functions up from `frame`, up to the
+         * first return address which is not a statepoint (main's caller).
+        */
+        void findRoots(void** frame) {
+            loadStackMaps();
+
+            for (auto fp = frame; fp != nullptr;) {
+                auto safePoint = safePoints_.find(reinterpret_cast<uintptr_t>(fp[1]));
+
+                if (safePoint == safePoints_.end()) {
+                    break;
+                }
+
+                // Registers of the caller at the call: SP above the return address, saved FP
+                auto callerSp = reinterpret_cast<uintptr_t>(fp + 2);
+                auto callerFp = static_cast<void**>(fp[0]);
+
+                auto locations = safePoint->second.locations;
+                auto count = safePoint->second.locationCount;
+
+                for (size_t i = 3 + locations[2].offset; i + 1 < count; i += 2) {
+                    auto base = slot(locations[i], callerSp, callerFp);
+                    auto derived = slot(locations[i + 1], callerSp, callerFp);
+
+                    if (base != nullptr) {
+                        roots_.push_back({base, derived != nullptr ? derived : base});
+                    }
+                }
+
+                fp = callerFp;
+            }
+        }
+
+        /**
+         * Frame slot of a location, or nullptr for constants (null objects)
+        */
+        static uintptr_t* slot(const Location& location, uintptr_t sp, void** fp) {
+            if (location.kind == CONSTANT || location.kind == CONSTANT_INDEX) {
+                return nullptr;
+            }
+
+            // Live objects are spilled at statepoints
+            if (location.kind != INDIRECT) {
+                die("Unsupported stack map location (objects should be spilled).");
+            }
+
+            uintptr_t base;
+
+            switch (location.regNum) {
+                case DWARF_RSP: base = sp; break;
+                case DWARF_RBP: base = reinterpret_cast<uintptr_t>(fp); break;
+                default: die("Unsupported stack map register.");
+            }
+
+            return reinterpret_cast<uintptr_t*>(base + location.offset);
+        }
+
+        /**
+         * Copies the live young objects to the old generation
+        */
+        void minorCollection() {
+            // Derived pointers follow their bases
+            offsets_.clear();
+
+            for (auto& root : roots_) {
+                offsets_.push_back(*root.derived - *root.base);
+            }
+
+            for (auto& root : roots_) {
+                *root.base = evacuate(*root.base);
+            }
+
+            for (size_t i = 0; i < roots_.size(); i++) {
+                if (roots_[i].derived != roots_[i].base) {
+                    *roots_[i].derived = *roots_[i].base + offsets_[i];
+                }
+            }
+
+            for (auto header : remembered_) {
+                header->word &= ~REMEMBERED;
+                scan(header);
+            }
+
+            remembered_.clear();
+
+            // Promoted objects may refer to more young objects
+            for (size_t i = 0; i < promoted_.size(); i++) {
+                scan(promoted_[i]);
+            }
+
+            promoted_.clear();
+
+            allocatedBytes_ += nurseryFree() - nursery_;
+            memset(nursery_, 0, nurseryFree() - nursery_);
+            eva_gc_nursery_top = nursery_ + sizeof(Header);
+
+            minorCollections_++;
+        }
+
+        /**
+         * Returns the address of an object after the minor collection
+        */
+        uintptr_t evacuate(uintptr_t object) {
+            if (object < reinterpret_cast<uintptr_t>(nursery_) || object >= reinterpret_cast<uintptr_t>(eva_gc_nursery_top)) {
+                return object;
+            }
+
+            auto header = reinterpret_cast<Header*>(object) - 1;
+
+            if (header->word & FORWARDED) {
+                return header->word & ~FLAGS;
+            }
+
+            auto size = objectSize(typeMapOf(header));
+            auto copy = allocateOld(size);
+
+            memcpy(copy, header, size);
+            header->word = reinterpret_cast<uintptr_t>(copy + 1) | FORWARDED;
+
+            promoted_.push_back(copy);
+            promotedBytes_ += size;
+
+            return reinterpret_cast<uintptr_t>(copy + 1);
+        }
+
+        void scan(Header* header) {
+            auto typeMap = typeMapOf(header);
+            auto offsets = pointerOffsets(typeMap);
+            auto object = reinterpret_cast<char*>(header + 1);
+
+            for (uint64_t i = 0; i < typeMap->pointerCount; i++) {
+                auto field = reinterpret_cast<uintptr_t*>(object + offsets[i]);
+                *field = evacuate(*field);
+            }
+        }
+
+        /**
+         * Marks the old generation from the roots and frees the rest.
+         * Runs after a minor collection, so every object is old.
+        */
+        void majorCollection() {
+            for (auto& root : roots_) {
+                mark(*root.base);
+            }
+
+            while (!marking_.empty()) {
+                auto header = marking_.back();
+                marking_.pop_back();
+
+                auto typeMap = typeMapOf(header);
+                auto offsets = pointerOffsets(typeMap);
+                auto object = reinterpret_cast<char*>(header + 1);
+
+                for (uint64_t i = 0; i < typeMap->pointerCount; i++) {
+                    mark(*reinterpret_cast<uintptr_t*>(object + offsets[i]));
+                }
+            }
+
+            for (auto it = oldObjects_.begin(); it != oldObjects_.end();) {
+                auto header = *it;
+
+                if (header->word & MARKED) {
+                    header->word &= ~MARKED;
+                    ++it;
+                    continue;
+                }
+
+                oldBytes_ -= objectSize(typeMapOf(header));
+                free(header);
+                it = oldObjects_.erase(it);
+            }
+
+            majorThreshold_ = std::max(MIN_MAJOR_THRESHOLD, 2 * oldBytes_);
+            majorCollections_++;
+        }
+
+        /**
+         * Marks an old object (roots may also be objects on the stack)
+        */
+        void mark(uintptr_t object) {
+            if (object == 0) {
+                return;
+            }
+
+            auto header = reinterpret_cast<Header*>(object) - 1;
+
+            if (oldObjects_.count(header) == 0 || (header->word & MARKED)) {
+                return;
+            }
+
+            header->word |= MARKED;
+            marking_.push_back(header);
+        }
+
+        Header* allocateOld(size_t size) {
+            auto header = static_cast<Header*>(malloc(size));
+
+            if (header == nullptr) {
+                die("Out of memory.");
+            }
+
+            oldObjects_.insert(header);
+            oldBytes_ += size;
+
+            return header;
+        }
+
+        /**
+         * Stack maps of the executable (read once), and those registered since the last collection
+        */
+        void loadStackMaps() {
+            if (!executableStackMapsLoaded_) {
+                executableStackMapsLoaded_ = true;
+                loadExecutableStackMaps();
+            }
+
+            std::lock_guard<std::mutex> lock(pendingMutex_);
+
+            for (auto& section : pendingStackMaps_) {
+                parseStackMap(section.first, section.second);
+            }
+
+            pendingStackMaps_.clear();
+        }
+
+        /**
+         * Finds the .llvm_stackmaps section (of all objects, concatenated) in the executable file
+        */
+        void loadExecutableStackMaps() {
+            auto file = fopen("/proc/self/exe", "rb");
+
+            if (file == nullptr) {
+                return;
+            }
+
+            Elf64_Ehdr elfHeader;
+            std::vector<Elf64_Shdr> sections;
+            std::vector<char> names;
+
+            auto valid = fread(&elfHeader, sizeof(elfHeader), 1, file) == 1 &&
+                         memcmp(elfHeader.e_ident, ELFMAG, SELFMAG) == 0 &&
+                         elfHeader.e_ident[EI_CLASS] == ELFCLASS64 &&
+                         elfHeader.e_shstrndx < elfHeader.e_shnum;
+
+            if (valid) {
+                sections.resize(elfHeader.e_shnum);
+                valid = fseek(file, elfHeader.e_shoff, SEEK_SET) == 0 &&
+                        fread(sections.data(), sizeof(Elf64_Shdr), sections.size(), file) == sections.size();
+            }
+
+            if (valid) {
+                auto& namesSection = sections[elfHeader.e_shstrndx];
+                names.resize(namesSection.sh_size + 1);
+                valid = fseek(file, namesSection.sh_offset, SEEK_SET) == 0 &&
+                        fread(names.data(), 1, namesSection.sh_size, file) == namesSection.sh_size;
+            }
+
+            fclose(file);
+
+            if (!valid) {
+                return;
+            }
+
+            // Load address of the executable (position-independent)
+            uintptr_t loadBias = 0;
+
+            dl_iterate_phdr([](dl_phdr_info* info, size_t, void* data) {
+                *static_cast<uintptr_t*>(data) = info->dlpi_addr;
+                return 1;
+            }, &loadBias);
+
+            for (auto& section : sections) {
+                if (section.sh_name < names.size() - 1 && strcmp(&names[section.sh_name], ".llvm_stackmaps") == 0 &&
+                    (section.sh_flags & SHF_ALLOC)) {
+                    parseStackMap(reinterpret_cast<const uint8_t*>(loadBias + section.sh_addr), section.sh_size);
+                }
+            }
+        }
+
+        /**
+         * Indexes the records of a stack map section by return address.
+         * A linked section is the stack maps of each object, one after another.
+        */
+        void parseStackMap(const uint8_t* p, uint64_t size) {
+            auto end = p + size;
+
+            while (p + 16 <= end) {
+                // Alignment between objects
+                if (p[0] == 0) {
+                    p += 8;
+                    continue;
+                }
+
+                if (p[0] != 3) {
+                    die("Unsupported stack map version.");
+                }
+
+                auto functionCount = read<uint32_t>(p + 4);
+                auto constantCount = read<uint32_t>(p + 8);
+
+                auto functions = p + 16;
+                p = functions + functionCount * 24 + constantCount * 8;
+
+                for (uint32_t i = 0; i < functionCount; i++) {
+                    auto address = read<uint64_t>(functions + i * 24);
+                    auto recordCount = read<uint64_t>(functions + i * 24 + 16);
+
+                    for (uint64_t j = 0; j < recordCount; j++) {
+                        auto offset = read<uint32_t>(p + 8);
+                        auto locationCount = read<uint16_t>(p + 14);
+                        auto locations = reinterpret_cast<const Location*>(p + 16);
+
+                        // Locations, live-outs (after their count), each padded to 8 bytes
+                        p = align8(p + 16 + locationCount * sizeof(Location));
+                        p = align8(p + 4 + read<uint16_t>(p + 2) * 4);
+
+                        safePoints_[address + offset] = {locations, locationCount};
+                    }
+                }
+            }
+        }
+
+        char* nursery_ = nullptr;
+        size_t nurserySize_ = 0;
+
+        /**
+         * Old generation
+        */
+        std::unordered_set<Header*> oldObjects_;
+        size_t oldBytes_ = 0;
+        size_t majorThreshold_ = MIN_MAJOR_THRESHOLD;
+
+        /**
+         * Old objects which may refer to young ones
+        */
+        std::vector<Header*> remembered_;
+
+        /**
+         * Work lists of the collections
+        */
+        std::vector<Root> roots_;
+        std::vector<uintptr_t> offsets_;
+        std::vector<Header*> promoted_;
+        std::vector<Header*> marking_;
+
+        /**
+         * Safepoints by return address
+        */
+        std::unordered_map<uintptr_t, SafePoint> safePoints_;
+        bool executableStackMapsLoaded_ = false;
+
+        /**
+         * Registered by the JIT, possibly from its compile threads
+        */
+        std::mutex pendingMutex_;
+        std::vector<std::pair<const uint8_t*, uint64_t>> pendingStackMaps_;
+
+        /**
+         * Statistics
+        */
+        size_t minorCollections_ = 0;
+        size_t majorCollections_ = 0;
+        size_t allocatedBytes_ = 0;
+        size_t promotedBytes_ = 0;
+};
+
+Heap& heap() {
+    static Heap instance;
+    return instance;
+}
+
+}
+
+extern "C" {
+
+void* eva_gc_alloc(const EvaTypeMap* typeMap) {
+    if (auto object = bumpAllocate(typeMap, objectSize(typeMap))) {
+        return object;
+    }
+
+    return heap().allocateSlow(typeMap, static_cast<void**>(__builtin_frame_address(0)));
+}
+
+void* eva_gc_alloc_slow(const EvaTypeMap* typeMap) {
+    return heap().allocateSlow(typeMap, static_cast<void**>(__builtin_frame_address(0)));
+}
+
+void eva_gc_write_barrier(void* object) {
+    auto address = static_cast<char*>(object);
+
+    // Young objects are scanned anyway
+    if (address >= nurseryBegin && address < nurseryEnd) {
+        return;
+    }
+
+    auto header = static_cast<Header*>(object) - 1;
+
+    if (!(header->word & REMEMBERED)) {
+        heap().remember(header);
+    }
+}
+
+void eva_gc_register_stack_map(const uint8_t* section, uint64_t size) {
+    heap().registerStackMap(section, size);
+}
+
+}
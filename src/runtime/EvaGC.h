@@ -0,0 +1,58 @@
+/**
+ * Eva runtime: precise, generational garbage collector
+*/
+
+#ifndef EvaGC_h
+#define EvaGC_h
+
+#include <cstdint>
+
+extern "C" {
+
+/**
+ * Layout of a class for the collector, emitted by the compiler
+ * (`<Class>_typeMap`): object size, and the offsets of the fields
+ * which hold objects, which follow the header.
+*/
+struct EvaTypeMap {
+    uint64_t size;
+    uint64_t pointerCount;
+};
+
+/**
+ * Allocates a zeroed object. May collect: the caller's frames are
+ * found through the stack maps of the statepoints (.llvm_stackmaps).
+*/
+void* eva_gc_alloc(const EvaTypeMap* typeMap);
+
+/**
+ * Nursery allocation pointer, for the fast path the compiler inlines:
+ * the address of the next object (past its header word), and its limit.
+ * An object taking `size` bytes with its header (rounded up to 8) fits
+ * if top + size <= limit; top is then bumped by `size`, and the header
+ * set to the type map. The nursery is kept zeroed.
+*/
+extern char* eva_gc_nursery_top;
+extern char* eva_gc_nursery_limit;
+
+/**
+ * Allocates when the inlined fast path does not fit (refills the
+ * nursery by a collection). May collect, as eva_gc_alloc.
+*/
+void* eva_gc_alloc_slow(const EvaTypeMap* typeMap);
+
+/**
+ * Records a store of an object into a field of `object`, which
+ * is remembered if it is in the old generation.
+*/
+void eva_gc_write_barrier(void* object);
+
+/**
+ * Registers the stack maps of code loaded at run time (by the JIT).
+ * Stack maps of the executable are found without registration.
+*/
+void eva_gc_register_stack_map(const uint8_t* section, uint64_t size);
+
+}
+
+#endif